@@ -0,0 +1,77 @@
+/*
+ * btree<> node layout benchmark: random inserts and lookups with the plain
+ * layout of btree_default_map_traits against the cache-line blocked layout
+ * of btree_blocked_map_traits.
+ *
+ * Pick n so that the tree is well above the last level cache (30M keys are
+ * about 1 GiB with long long keys); 1M keys shows the in-cache case. Run
+ * each configuration in its own process so that one tree's pages don't
+ * slow down the next.
+ *
+ * Build from the repository root:
+ *    g++ -std=c++14 -O2 -march=native -Isrc bench/btree_layout_bench.cpp -o btree_layout_bench
+ * Usage:
+ *    btree_layout_bench <layout> <n> [lookups]
+ *    layout: 0 long long default, 1 long long blocked, 2 int default, 3 int blocked
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "btree.h"
+
+template <class Key, class Traits>
+static void Run(const char * name, long n, long lookups) {
+    btree<Key, Key, Traits> tree;
+
+    // keys from four times the number of inserts, so that some lookups miss
+    std::mt19937_64 rng(1);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (long i = 0; i < n; i++) {
+        Key key = (Key) (rng() % (4 * n));
+        tree.insert(key, key);
+    }
+    std::chrono::steady_clock::time_point inserted = std::chrono::steady_clock::now();
+
+    std::mt19937_64 queries(7);
+    long hits = 0;
+    for (long i = 0; i < lookups; i++) {
+        hits += tree.exists((Key) (queries() % (4 * n)));
+    }
+    std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+
+    printf("%-12s n=%ld insert %.0f ns/op, lookup %.0f ns/op (hits %ld)\n", name, n,
+           std::chrono::duration<double, std::nano>(inserted - start).count() / n,
+           std::chrono::duration<double, std::nano>(done - inserted).count() / lookups, hits);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <layout 0-3> <n> [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    int layout = atoi(argv[1]);
+    long n = atol(argv[2]);
+    long lookups = argc > 3 ? atol(argv[3]) : 5000000;
+
+    switch (layout) {
+    case 0:
+        Run<long long, btree_default_map_traits<long long, long long> >("ll default", n, lookups);
+        break;
+    case 1:
+        Run<long long, btree_blocked_map_traits<long long, long long> >("ll blocked", n, lookups);
+        break;
+    case 2:
+        Run<int, btree_default_map_traits<int, int> >("int default", n, lookups);
+        break;
+    case 3:
+        Run<int, btree_blocked_map_traits<int, int> >("int blocked", n, lookups);
+        break;
+    default:
+        fprintf(stderr, "unknown layout %d\n", layout);
+        return 1;
+    }
+    return 0;
+}
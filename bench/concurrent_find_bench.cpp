@@ -0,0 +1,117 @@
+/*
+ * concurrent_find() throughput: lookups of random keys in a bulk loaded
+ * INT64 tree with find(), with 1 and 4 concurrent_find() readers, and with
+ * 4 readers while a writer keeps calling concurrent_insert().
+ *
+ * Build from the repository root:
+ *    g++ -std=c++14 -O2 -pthread -Isrc bench/concurrent_find_bench.cpp src/MemoryPage.cpp -o concurrent_find_bench
+ * Usage:
+ *    concurrent_find_bench [keys] [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "persistentbtree.h"
+
+static const char * TABLE = "concurrent_find_table";
+
+/// Time lookups of the even keys 0 .. 2 * (keys - 1), split over readers
+/// threads, with an inserter of odd keys running alongside if writer is set
+static void Run(PersistentBTree & tree, long keys, long lookups, int readers, bool writer) {
+    std::atomic<bool> stop(false);
+    std::atomic<long> inserts(0);
+    std::thread inserter;
+
+    if (writer) {
+        inserter = std::thread([&] {
+            std::mt19937 rng(5);
+            char kb[8];
+            long long one = 1;
+            while (!stop) {
+                KeyEncoding::EncodeInt(kb, 2LL * (rng() % keys) + 1, 8);
+                tree.concurrent_insert(DataType(tree.GetKeyStructure(), kb), DataType(tree.GetDataStructure(), (char*) &one));
+                inserts++;
+            }
+        });
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int r = 0; r < readers; r++) {
+        threads.push_back(std::thread([&, r] {
+            std::mt19937 rng(r);
+            char kb[8];
+            long long out;
+            for (long i = 0; i < lookups / readers; i++) {
+                KeyEncoding::EncodeInt(kb, 2LL * (rng() % keys), 8);
+                DataType key(tree.GetKeyStructure(), kb), data(tree.GetDataStructure(), (char*) &out);
+                tree.concurrent_find(key, data);
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    stop = true;
+    if (writer) {
+        inserter.join();
+    }
+
+    printf("concurrent_find(), %d reader%s%s: %.0f ns/lookup, %ld inserts\n", readers, readers > 1 ? "s" : "",
+           writer ? " + writer" : "", ns / lookups, (long) inserts);
+}
+
+int main(int argc, char ** argv) {
+    long keys = argc > 1 ? atol(argv[1]) : 500000;
+    long lookups = argc > 2 ? atol(argv[2]) : 1000000;
+
+    PersistentBTree tree;
+    DataStructure keyStruct(std::vector<std::string>(1, "INT64"));
+    DataStructure dataStruct(std::vector<std::string>(1, "INT64"));
+    tree.create(TABLE, keyStruct, dataStruct);
+    tree.open(TABLE);
+    if (!tree.is_open()) {
+        fprintf(stderr, "can't create %s\n", TABLE);
+        return 1;
+    }
+
+    std::vector<char> kb(keys * 8);
+    std::vector<long long> values(keys);
+    std::vector<PersistentBTree::pair_type> pairs;
+    for (long i = 0; i < keys; i++) {
+        KeyEncoding::EncodeInt(&kb[i * 8], 2LL * i, 8);
+        values[i] = i;
+        pairs.push_back(PersistentBTree::pair_type(DataType(tree.GetKeyStructure(), &kb[i * 8]),
+                                                   DataType(tree.GetDataStructure(), (char*) &values[i])));
+    }
+    tree.bulk_load(pairs.begin(), pairs.end());
+
+    std::mt19937 rng(0);
+    char key[8];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (long i = 0; i < lookups; i++) {
+        KeyEncoding::EncodeInt(key, 2LL * (rng() % keys), 8);
+        tree.find(DataType(tree.GetKeyStructure(), key));
+    }
+    printf("find(): %.0f ns/lookup\n",
+           std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups);
+
+    Run(tree, keys, lookups, 1, false);
+    Run(tree, keys, lookups, 4, false);
+    Run(tree, keys, lookups, 4, true);
+
+    tree.clear();
+    ::remove(TABLE);
+    ::remove((std::string(TABLE) + "_header").c_str());
+    return 0;
+}
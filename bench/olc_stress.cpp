@@ -0,0 +1,188 @@
+/*
+ * Stress test of concurrent_find() against the concurrent_* writers.
+ *
+ * The tree holds stable keys 0, 2, 4, ... with the data 7 * key. Reader
+ * threads look up random keys while one writer inserts, updates and
+ * erases the odd keys in between, whose data always ends in the last
+ * three digits of the key. A reader fails if a stable key is missing or
+ * has other data, or an odd key has data that no write gave it. At the
+ * end the tree must hold what a std::map that saw the same writes holds.
+ *
+ * Build from the repository root:
+ *    g++ -std=c++14 -O2 -pthread -Isrc bench/olc_stress.cpp src/MemoryPage.cpp -o olc_stress
+ * Usage:
+ *    olc_stress [stable keys] [writes] [readers] [node slots] [native] [inserts]
+ *    A small node size (e.g. 8) makes the writer split and merge often,
+ *    native uses keys that don't compare with memcmp. With inserts the
+ *    writer only inserts, so that with small nodes the readers keep
+ *    landing on nodes that were split after they left the parent and have
+ *    to follow the B-link right links.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <climits>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "persistentbtree.h"
+
+static const char * TABLE = "olc_stress_table";
+
+static void EncodeKey(char * buf, int key, bool memcmpKeys) {
+    if (memcmpKeys) {
+        KeyEncoding::EncodeInt(buf, key, sizeof(int));
+    }
+    else {
+        memcpy(buf, &key, sizeof(int));
+    }
+}
+
+/// Pairs that differ between the tree and ref, by lookups and by a scan
+static long Compare(PersistentBTree & tree, const std::map<int, long long> & ref, bool memcmpKeys) {
+    long bad = 0;
+    char kb[sizeof(int)];
+
+    for (std::map<int, long long>::const_iterator it = ref.begin(); it != ref.end(); ++it) {
+        EncodeKey(kb, it->first, memcmpKeys);
+        DataType key(tree.GetKeyStructure(), kb);
+
+        PersistentBTree::iterator found = tree.find(key);
+        if (found == tree.End() || found.data_view().GetInt(0) != it->second) {
+            bad++;
+        }
+    }
+
+    char lo[sizeof(int)], hi[sizeof(int)];
+    EncodeKey(lo, INT_MIN, memcmpKeys);
+    EncodeKey(hi, INT_MAX, memcmpKeys);
+
+    std::map<int, long long>::const_iterator expected = ref.begin();
+    size_t n = tree.scan(DataType(tree.GetKeyStructure(), lo), DataType(tree.GetKeyStructure(), hi),
+                         [&](const DataView & key, const DataView & data) {
+        if (expected == ref.end() || key.GetInt(0) != expected->first || data.GetInt(0) != expected->second) {
+            bad++;
+        }
+        if (expected != ref.end()) {
+            ++expected;
+        }
+    });
+
+    if (n != ref.size()) {
+        bad++;
+    }
+    return bad;
+}
+
+int main(int argc, char ** argv) {
+    int stable = argc > 1 ? atoi(argv[1]) : 20000;
+    int writes = argc > 2 ? atoi(argv[2]) : 100000;
+    int readers = argc > 3 ? atoi(argv[3]) : 4;
+    int nodeSlots = argc > 4 ? atoi(argv[4]) : 0;
+    bool memcmpKeys = true, insertsOnly = false;
+    for (int i = 5; i < argc; i++) {
+        memcmpKeys = memcmpKeys && std::string(argv[i]) != "native";
+        insertsOnly = insertsOnly || std::string(argv[i]) == "inserts";
+    }
+
+    PersistentBTree tree;
+    DataStructure keys(std::vector<std::string>(1, "INT"));
+    DataStructure data(std::vector<std::string>(1, "INT64"));
+    tree.create(TABLE, keys, data, memcmpKeys);
+    tree.open(TABLE);
+    if (!tree.is_open()) {
+        fprintf(stderr, "can't create %s\n", TABLE);
+        return 1;
+    }
+    if (nodeSlots > 0) {
+        tree.setNodeSize(nodeSlots);
+    }
+
+    std::map<int, long long> ref;
+    char kb[sizeof(int)];
+
+    for (int i = 0; i < stable; i++) {
+        int k = 2 * i;
+        long long v = 7LL * k;
+        EncodeKey(kb, k, memcmpKeys);
+        tree.concurrent_insert(DataType(tree.GetKeyStructure(), kb), DataType(tree.GetDataStructure(), (char*) &v));
+        ref[k] = v;
+    }
+
+    std::atomic<bool> stop(false);
+    std::atomic<long> bad(0), reads(0);
+    std::vector<std::thread> threads;
+
+    for (int r = 0; r < readers; r++) {
+        threads.push_back(std::thread([&, r] {
+            std::mt19937 rng(r);
+            char rkb[sizeof(int)];
+            long long out;
+
+            while (!stop) {
+                int k = rng() % (2 * stable);
+                EncodeKey(rkb, k, memcmpKeys);
+                DataType key(tree.GetKeyStructure(), rkb), result(tree.GetDataStructure(), (char*) &out);
+
+                bool found = tree.concurrent_find(key, result);
+                reads++;
+
+                if (k % 2 == 0 ? !found || out != 7LL * k : found && out % 1000 != k % 1000) {
+                    bad++;
+                }
+            }
+        }));
+    }
+
+    std::mt19937 rng(99);
+    for (int i = 0; i < writes; i++) {
+        int k = 2 * (rng() % stable) + 1;
+        if (insertsOnly && ref.count(k)) {
+            // a new key past the stable ones, which splits the last leaves
+            k = 2 * (stable + i) + 1;
+        }
+        long long v = (long long) (rng() % 1000000) * 1000 + k % 1000;
+        EncodeKey(kb, k, memcmpKeys);
+        DataType key(tree.GetKeyStructure(), kb), value(tree.GetDataStructure(), (char*) &v);
+
+        switch (insertsOnly ? 0 : rng() % 3) {
+        case 0:
+            if (!ref.count(k)) {
+                tree.concurrent_insert(key, value);
+                ref[k] = v;
+            }
+            break;
+        case 1:
+            if (tree.concurrent_erase(key) != (ref.erase(k) > 0)) {
+                bad++;
+            }
+            break;
+        default:
+            if (tree.concurrent_update(key, value) != (ref.count(k) > 0)) {
+                bad++;
+            }
+            else if (ref.count(k)) {
+                ref[k] = v;
+            }
+            break;
+        }
+    }
+
+    stop = true;
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    long mismatches = Compare(tree, ref, memcmpKeys);
+    printf("%ld reads, %ld bad reads or writes, %ld mismatches with std::map\n", (long) reads, (long) bad, mismatches);
+
+    tree.clear();
+    ::remove(TABLE);
+    ::remove((std::string(TABLE) + "_header").c_str());
+
+    return bad != 0 || mismatches != 0;
+}
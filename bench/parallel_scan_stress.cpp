@@ -0,0 +1,170 @@
+/*
+ * Checks parallel_scan() against scan(): random ranges of a tree with
+ * duplicate keys, with 1 to 8 threads. The pairs of all parts, put
+ * together by part number, must be the pairs of scan() in the same order.
+ * With timed pairs, a tree of that many pairs is also scanned with
+ * parallel_scan() on 4 threads and with scan(), and both are timed.
+ *
+ * Build from the repository root:
+ *    g++ -std=c++14 -O2 -pthread -Isrc bench/parallel_scan_stress.cpp src/MemoryPage.cpp -o parallel_scan_stress
+ * and with -fsanitize=thread -g instead of -O2 for the ThreadSanitizer run.
+ * Usage:
+ *    parallel_scan_stress [pairs] [node slots] [key range] [timed pairs]
+ *    A small node size (e.g. 8) gives many levels and parts, a key range
+ *    below the number of pairs gives duplicates.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <climits>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "persistentbtree.h"
+
+static const char * TABLE = "parallel_scan_table";
+
+typedef std::vector<std::pair<long long, long long> > pair_list;
+
+static DataType Key(PersistentBTree & tree, char * buf, int key) {
+    KeyEncoding::EncodeInt(buf, key, sizeof(int));
+    return DataType(tree.GetKeyStructure(), buf);
+}
+
+static void Create(PersistentBTree & tree, int nodeSlots) {
+    DataStructure keys(std::vector<std::string>(1, "INT"));
+    DataStructure data(std::vector<std::string>(1, "INT64"));
+    tree.create(TABLE, keys, data);
+    tree.open(TABLE);
+    if (nodeSlots > 0) {
+        tree.setNodeSize(nodeSlots);
+    }
+}
+
+static void Remove(PersistentBTree & tree) {
+    tree.clear();
+    ::remove(TABLE);
+    ::remove((std::string(TABLE) + "_header").c_str());
+}
+
+/// parallel_scan() of [lo, hi) with threads workers against scan()
+static bool Check(PersistentBTree & tree, int lo, int hi, unsigned int threads) {
+    char lb[sizeof(int)], hb[sizeof(int)];
+    DataType from = Key(tree, lb, lo), to = Key(tree, hb, hi);
+
+    pair_list expected;
+    tree.scan(from, to, [&](const DataView & key, const DataView & data) {
+        expected.push_back(std::make_pair(key.GetInt(0), data.GetInt(0)));
+    });
+
+    std::mutex mutex;
+    std::map<size_t, pair_list> parts;
+    size_t n = tree.parallel_scan(from, to, threads, [&](size_t part, const DataView & key, const DataView & data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        parts[part].push_back(std::make_pair(key.GetInt(0), data.GetInt(0)));
+    });
+
+    pair_list got;
+    for (std::map<size_t, pair_list>::iterator it = parts.begin(); it != parts.end(); ++it) {
+        got.insert(got.end(), it->second.begin(), it->second.end());
+    }
+
+    if (got != expected || n != expected.size()) {
+        printf("[%d, %d) with %u threads: %zu pairs in %zu parts, scan() has %zu\n", lo, hi, threads,
+               got.size(), parts.size(), expected.size());
+        return false;
+    }
+    return true;
+}
+
+static void Timed(int pairs) {
+    PersistentBTree tree;
+    Create(tree, 0);
+
+    std::vector<char> kb(pairs * sizeof(int));
+    std::vector<long long> values(pairs);
+    std::vector<PersistentBTree::pair_type> sorted;
+    for (int i = 0; i < pairs; i++) {
+        values[i] = i;
+        sorted.push_back(PersistentBTree::pair_type(Key(tree, &kb[i * sizeof(int)], i),
+                                                    DataType(tree.GetDataStructure(), (char*) &values[i])));
+    }
+    tree.bulk_load(sorted.begin(), sorted.end());
+
+    char lb[sizeof(int)], hb[sizeof(int)];
+    DataType from = Key(tree, lb, INT_MIN), to = Key(tree, hb, INT_MAX);
+
+    for (int parallel = 0; parallel < 2; parallel++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        size_t n;
+        if (parallel) {
+            // one sum per part, parallel_scan() cuts at most four per thread
+            std::vector<long long> sums(4 * 4, 0);
+            n = tree.parallel_scan(from, to, 4, [&](size_t part, const DataView &, const DataView & data) {
+                sums[part] += data.GetInt(0);
+            });
+        }
+        else {
+            long long sum = 0;
+            n = tree.scan(from, to, [&](const DataView &, const DataView & data) {
+                sum += data.GetInt(0);
+            });
+        }
+
+        printf("%s: %zu pairs in %.0f ms\n", parallel ? "parallel_scan(), 4 threads" : "scan()", n,
+               std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    Remove(tree);
+}
+
+int main(int argc, char ** argv) {
+    int pairs = argc > 1 ? atoi(argv[1]) : 20000;
+    int nodeSlots = argc > 2 ? atoi(argv[2]) : 0;
+    int range = argc > 3 ? atoi(argv[3]) : 1000000;
+    int timed = argc > 4 ? atoi(argv[4]) : 0;
+
+    PersistentBTree tree;
+    Create(tree, nodeSlots);
+    if (!tree.is_open()) {
+        fprintf(stderr, "can't create %s\n", TABLE);
+        return 1;
+    }
+
+    int bad = 0;
+    char kb[sizeof(int)];
+
+    // an empty tree has nothing to split
+    if (!Check(tree, 0, 100, 4)) {
+        bad++;
+    }
+
+    std::mt19937 rng(11);
+    for (int i = 0; i < pairs; i++) {
+        long long v = i;
+        tree.insert(Key(tree, kb, rng() % range), DataType(tree.GetDataStructure(), (char*) &v));
+    }
+
+    for (int q = 0; q < 60; q++) {
+        // every fourth range covers the whole tree, the others get shorter
+        int lo = q % 4 == 0 ? INT_MIN / 2 : (int) (rng() % range);
+        int hi = q % 4 == 0 ? INT_MAX / 2 : lo + (int) (rng() % (range / (1 + q % 5)));
+
+        if (!Check(tree, lo, hi, 1 + q % 8)) {
+            bad++;
+        }
+    }
+    printf("%d of 61 ranges differ from scan()\n", bad);
+
+    Remove(tree);
+
+    if (timed > 0) {
+        Timed(timed);
+    }
+    return bad != 0;
+}
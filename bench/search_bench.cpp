@@ -0,0 +1,288 @@
+/*
+ * Node search microbenchmark, the numbers behind the defaults of
+ * PersistentBTree::choose_search() and SimdSearch::DefaultWindow().
+ *
+ * Looks up keys in 64 sorted nodes of the size of a 4 KiB leaf and prints
+ * the ns per search:
+ *  - SimdSearch::LowerBound() with binary narrowing (b<window>) and with
+ *    interpolation (i<window>), blin is a SIMD scan of the whole node
+ *  - a branchy scalar binary search for reference
+ *  - whole-node scans of btree<> sized nodes
+ *  - branchy against branch-free binary search on memcmp keys
+ *
+ * Build from the repository root:
+ *    g++ -std=c++14 -O2 -march=native -Isrc bench/search_bench.cpp -o search_bench
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "data_structures.h"
+#include "simd_search.h"
+
+static const int NODES = 64;
+static const int QUERIES = 2000000;
+
+enum Distribution { dense, uniform, skewed, skewed_slice };
+
+static const char * DISTRIBUTION_NAMES[] = { "dense", "uniform", "skewed", "skewed-slice" };
+
+template <typename T>
+struct Node {
+    std::vector<T> values;
+    std::vector<char> keys;
+};
+
+/// The keys of a node sized slice of a skewed key set, as a leaf of a tree
+/// over that set would hold them
+template <typename T>
+static void SkewedSlice(std::vector<T> & values, int n, std::mt19937_64 & rng) {
+    static std::vector<T> all;
+    if (all.size() != (size_t) n * 4000) {
+        std::mt19937_64 r(9);
+        all.clear();
+        for (int i = 0; i < n * 4000; i++) {
+            all.push_back((T) std::exp((double) (r() % 1000000) / 40000.0));
+        }
+        std::sort(all.begin(), all.end());
+    }
+
+    size_t offset = (rng() % 4000) * n;
+    std::copy(all.begin() + offset, all.begin() + offset + n, values.begin());
+}
+
+template <typename T>
+static void Store(char * dst, T value, bool encoded) {
+    if (encoded) {
+        KeyEncoding::EncodeInt(dst, value, sizeof(T));
+    }
+    else {
+        memcpy(dst, &value, sizeof(T));
+    }
+}
+
+template <typename T>
+static Node<T> MakeNode(int n, Distribution dist, bool encoded, std::mt19937_64 & rng) {
+    Node<T> node;
+    node.values.resize(n);
+
+    if (dist == skewed_slice) {
+        SkewedSlice(node.values, n, rng);
+    }
+    else {
+        for (int i = 0; i < n; i++) {
+            if (dist == dense) {
+                node.values[i] = (T) (i * 3 + 1000);
+            }
+            else if (dist == uniform) {
+                node.values[i] = (T) (rng() % ((uint64_t) 1 << (sizeof(T) * 8 - 2)));
+            }
+            else {
+                node.values[i] = (T) std::exp((double) (rng() % 100000) / 4000.0);
+            }
+        }
+    }
+    std::sort(node.values.begin(), node.values.end());
+
+    node.keys.resize(n * sizeof(T));
+    for (int i = 0; i < n; i++) {
+        Store(&node.keys[i * sizeof(T)], node.values[i], encoded);
+    }
+    return node;
+}
+
+struct Query {
+    int node;
+    char key[8];
+};
+
+template <typename T>
+static double BranchyLowerBound(const std::vector<Node<T> > & nodes, const std::vector<Query> & queries,
+                                int n, bool encoded, long long & check) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    long long acc = 0;
+    for (size_t q = 0; q < queries.size(); q++) {
+        const char * keys = &nodes[queries[q].node].keys[0];
+        int64_t key = SimdSearch::Load(queries[q].key, sizeof(T), encoded);
+
+        int lo = 0, hi = n;
+        while (lo < hi) {
+            int mid = (lo + hi) >> 1;
+            if (key <= SimdSearch::Load(keys + mid * sizeof(T), sizeof(T), encoded)) {
+                hi = mid;
+            }
+            else {
+                lo = mid + 1;
+            }
+        }
+        acc += lo;
+    }
+
+    check = acc;
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / queries.size();
+}
+
+template <typename T>
+static double SimdLowerBound(const std::vector<Node<T> > & nodes, const std::vector<Query> & queries,
+                             int n, bool encoded, int window, SimdSearch::Method method, long long & check) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    long long acc = 0;
+    for (size_t q = 0; q < queries.size(); q++) {
+        acc += SimdSearch::LowerBound(&nodes[queries[q].node].keys[0], n, queries[q].key, sizeof(T),
+                                      encoded, window, method);
+    }
+
+    check = acc;
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / queries.size();
+}
+
+/// Keys of the nodes and their neighbours, so that hits and misses mix
+template <typename T>
+static std::vector<Query> MakeQueries(const std::vector<Node<T> > & nodes, int n, bool encoded, std::mt19937_64 & rng) {
+    std::vector<Query> queries(QUERIES);
+    for (size_t q = 0; q < queries.size(); q++) {
+        queries[q].node = rng() % nodes.size();
+        T key = nodes[queries[q].node].values[rng() % n] + (T) (rng() % 3) - 1;
+        Store(queries[q].key, key, encoded);
+    }
+    return queries;
+}
+
+/// Leaf sized nodes: the windows and methods choose_search() picks from
+template <typename T>
+static void LeafSearch(const char * name, int n, bool encoded) {
+    static const int WINDOWS[] = { 1, 8, 16, 32, 64, 128, 100000 };
+    std::mt19937_64 rng(7);
+
+    for (int dist = dense; dist <= skewed_slice; dist++) {
+        std::vector<Node<T> > nodes;
+        for (int i = 0; i < NODES; i++) {
+            nodes.push_back(MakeNode<T>(n, (Distribution) dist, encoded, rng));
+        }
+        std::vector<Query> queries = MakeQueries(nodes, n, encoded, rng);
+
+        long long expected, check;
+        double branchy = BranchyLowerBound(nodes, queries, n, encoded, expected);
+
+        printf("%s n=%d %s %s:", name, n, encoded ? "encoded" : "native", DISTRIBUTION_NAMES[dist]);
+
+        for (int m = 0; m < 2; m++) {
+            SimdSearch::Method method = m ? SimdSearch::interpolation : SimdSearch::binary;
+
+            for (size_t w = 0; w < sizeof(WINDOWS) / sizeof(WINDOWS[0]); w++) {
+                // interpolation needs a window to check its guess in
+                if (method == SimdSearch::interpolation && (WINDOWS[w] == 1 || WINDOWS[w] > 64)) {
+                    continue;
+                }
+
+                double ns = SimdLowerBound(nodes, queries, n, encoded, WINDOWS[w], method, check);
+                printf(" %s%s=%.1f%s", m ? "i" : "b", WINDOWS[w] >= n ? "lin" : std::to_string(WINDOWS[w]).c_str(),
+                       ns, check == expected ? "" : "(MISMATCH)");
+            }
+        }
+        printf(" branchy=%.1f\n", branchy);
+    }
+}
+
+/// btree<> nodes fit in the default window and are scanned completely
+template <typename T>
+static void SmallNodeScan(const char * name, int n) {
+    std::mt19937_64 rng(7);
+
+    std::vector<Node<T> > nodes;
+    for (int i = 0; i < NODES; i++) {
+        nodes.push_back(MakeNode<T>(n, uniform, false, rng));
+    }
+    std::vector<Query> queries = MakeQueries(nodes, n, false, rng);
+
+    long long expected, check;
+    double branchy = BranchyLowerBound(nodes, queries, n, false, expected);
+    double scan = SimdLowerBound(nodes, queries, n, false, SimdSearch::DefaultWindow(sizeof(T)), SimdSearch::binary, check);
+
+    printf("%s n=%d native: scan=%.1f%s branchy=%.1f\n", name, n, scan, check == expected ? "" : "(MISMATCH)", branchy);
+}
+
+/// Multi-column and string keys compare with memcmp
+template <int KEYSIZE>
+static void MemcmpSearch(int n) {
+    std::mt19937_64 rng(1);
+
+    std::vector<std::vector<char> > nodes(NODES, std::vector<char>(n * KEYSIZE));
+    for (size_t i = 0; i < nodes.size(); i++) {
+        // few distinct bytes, so that the compares go deep into the keys
+        std::vector<std::string> keys(n, std::string(KEYSIZE, '\0'));
+        for (int k = 0; k < n; k++) {
+            for (int b = 0; b < KEYSIZE; b++) {
+                keys[k][b] = (char) (rng() % 4);
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        for (int k = 0; k < n; k++) {
+            memcpy(&nodes[i][k * KEYSIZE], keys[k].data(), KEYSIZE);
+        }
+    }
+
+    std::vector<std::pair<int, int> > queries(QUERIES);
+    for (size_t q = 0; q < queries.size(); q++) {
+        queries[q] = std::make_pair((int) (rng() % NODES), (int) (rng() % n));
+    }
+
+    for (int branchfree = 0; branchfree < 2; branchfree++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        long long acc = 0;
+        for (size_t q = 0; q < queries.size(); q++) {
+            const char * keys = &nodes[queries[q].first][0];
+            const char * key = keys + queries[q].second * KEYSIZE;
+
+            int lo = 0;
+            if (branchfree) {
+                int len = n;
+                while (len > 0) {
+                    int half = len >> 1;
+                    bool less = memcmp(keys + (lo + half) * KEYSIZE, key, KEYSIZE) < 0;
+                    lo = less ? lo + half + 1 : lo;
+                    len = less ? len - half - 1 : half;
+                }
+            }
+            else {
+                int hi = n;
+                while (lo < hi) {
+                    int mid = (lo + hi) >> 1;
+                    if (memcmp(key, keys + mid * KEYSIZE, KEYSIZE) <= 0) {
+                        hi = mid;
+                    }
+                    else {
+                        lo = mid + 1;
+                    }
+                }
+            }
+            acc += lo;
+        }
+
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / queries.size();
+        printf("memcmp keysize=%d n=%d %s: %.1f (%lld)\n", KEYSIZE, n, branchfree ? "branch-free" : "branchy", ns, acc);
+    }
+}
+
+int main() {
+    // the slots of a 4 KiB leaf with an 8 byte data column
+    LeafSearch<int32_t>("INT", 337, true);
+    LeafSearch<int64_t>("INT64", 252, true);
+
+    SmallNodeScan<int32_t>("INT", 32);
+    SmallNodeScan<int64_t>("INT64", 16);
+
+    MemcmpSearch<12>(252);
+    MemcmpSearch<16>(204);
+    MemcmpSearch<40>(87);
+
+    return 0;
+}
@@ -35,7 +35,7 @@ MemoryNodeImpl::MemoryNodeImpl(MemoryPageManager * mgr, boost::iostreams::mapped
 #ifdef __unix__
 MemoryNodeImpl::~MemoryNodeImpl() {
 
-    m_mgr->DeleteFromCache(m_page->id);
+    m_mgr->DeleteFromCache(m_page->id, this);
     munmap((void *) m_page, m_fileParams.size);
     close(m_fd);
 
@@ -43,7 +43,7 @@ MemoryNodeImpl::~MemoryNodeImpl() {
 #else
 MemoryNodeImpl::~MemoryNodeImpl() {
 
-    m_mgr->DeleteFromCache(m_page->id);
+    m_mgr->DeleteFromCache(m_page->id, this);
     m_fileMap.close();
 
 }
@@ -69,13 +69,13 @@ inline int MemoryNodeImpl::GetChild(int slot) {
 }
 
 inline void MemoryNodeImpl::SetKey(int slot, DataType & data) {
-    char * ptr = ((char *)m_page->data.slotdata) + m_mgr->DataSize()*slot;
-    memcpy(ptr, data.Data(), m_mgr->KeySize());
+    char * ptr = ((char *)m_page->slotkey) + m_mgr->KeySize()*slot;
+    memmove(ptr, data.Data(), m_mgr->KeySize());
 }
 
 inline void MemoryNodeImpl::SetData(int slot, DataType & data) {
-    char * ptr = ((char *)m_page->data.childid) + sizeof(int)*slot;
-    memcpy(ptr, data.Data(), m_mgr->DataSize());
+    char * ptr = ((char *)m_page->data.slotdata) + m_mgr->DataSize()*slot;
+    memmove(ptr, data.Data(), m_mgr->DataSize());
 }
 
 inline void MemoryNodeImpl::SetChild(int slot, int c) {
@@ -22,6 +22,9 @@
 #include <iostream>
 #include <iterator>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <climits>
 #include <math.h>
 
 #include "data_structures.h"
@@ -40,8 +43,14 @@ struct MemoryPage {
 	} data;
 	int prevleaf;
 	int nextleaf;
+	unsigned int version;	// odd while a writer latches the page, see PersistentBTree::latch_page()
+	unsigned int linkepoch;	// link epoch in which the high key and right link were set
 };
 
+// Bytes of the (sum, min, max) summary of the aggregated data column that
+// inner nodes keep per child, three 8 byte values
+const int AGGREGATE_SUMMARY_SIZE = 3 * 8;
+
 struct MemoryHeader {
 	bool init;
 	int nPages;
@@ -49,7 +58,7 @@ struct MemoryHeader {
 	int headLeaf;
 	int tailLeaf;
 	int usedPages;
-	int size;
+	off_t size;		// bytes of the page file, which can pass 2 GiB
 	int nKeyTypes;
 	int nDataTypes;
 	int key_type[64];
@@ -60,11 +69,18 @@ struct MemoryHeader {
 	int dataSize;
 	int keySize;
 	int nSlots;
+	int keyEncoding;	// 1 if the keys are stored memcomparable (KeyEncoding)
+	int innerSlots;		// key slots of inner nodes, less than nSlots with message buffers
+	int bufferSlots;	// messages buffered per inner node, 0 for a plain B+ tree
+	int pendingMessages;	// messages in all buffers that are not applied yet
+	unsigned int linkEpoch;	// last link epoch handed out, see NextLinkEpoch()
+	int subtreeCounts;	// 1 if inner nodes keep the key count of every child
+	int aggregateColumn;	// 1 + the data column summarised per child, 0 for none
 };
 
 struct mmap_params {
-    int size;
-    int offset;
+    size_t size;
+    off_t offset;
     std::string path;
 };
 
@@ -81,7 +97,7 @@ struct MemoryNodeImpl {
 #endif
 	MemoryPage * m_page;
 	MemoryPageManager * m_mgr;
-    int m_count;
+    std::atomic<int> m_count;
 
 #ifdef __unix__
 	MemoryNodeImpl(MemoryPageManager * mgr, mmap_params & params);
@@ -98,6 +114,18 @@ struct MemoryNodeImpl {
 		return --m_count;
 	}
 
+	// Take a reference unless the last one is already released and the
+	// mapping is about to be destroyed
+	bool TryAddRef() {
+		int c = m_count.load();
+		while (c > 0) {
+			if (m_count.compare_exchange_weak(c, c + 1)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
 	DataType GetKey(int slot);
 
 	DataType GetData(int slot);
@@ -132,7 +160,8 @@ public:
 #endif
 
 	MemoryNode(const MemoryNode& n) : m_memNodeImpl(n.m_memNodeImpl) {
-		m_memNodeImpl->AddRef();
+		if (m_memNodeImpl != NULL)
+			m_memNodeImpl->AddRef();
 	}
 
 	~MemoryNode() {
@@ -167,7 +196,8 @@ public:
 			}
 
 			m_memNodeImpl = n.m_memNodeImpl;
-			m_memNodeImpl->AddRef();
+			if (m_memNodeImpl != NULL)
+				m_memNodeImpl->AddRef();
 		}
 		return *this;
 	}
@@ -176,6 +206,16 @@ public:
 		return m_memNodeImpl != NULL;
 	}
 
+	// Two handles are the same node if they share the mapping. A page stays
+	// in the cache while any handle references it, so this is exact.
+	bool operator==(const MemoryNode & n) const {
+		return m_memNodeImpl == n.m_memNodeImpl;
+	}
+
+	bool operator!=(const MemoryNode & n) const {
+		return m_memNodeImpl != n.m_memNodeImpl;
+	}
+
 	DataType GetKey(int slot);
 
 	DataType GetData(int slot);
@@ -191,7 +231,7 @@ public:
 
 class MemoryPageManager {
 public:
-	MemoryPageManager() : m_header(NULL), m_headerFD(-1), activePage(-1) {
+	MemoryPageManager() : m_header(NULL), m_headerFD(-1), m_readaheadFD(-1), activePage(-1) {
 	}
 
 	~MemoryPageManager() {
@@ -220,7 +260,13 @@ public:
 	    return m_header != NULL;
 	}
 
-	void Create(const std::string & name, const DataStructure & keyStruct, const DataStructure & dataStruct) {
+	// innerSlots > 0 limits inner nodes to that many keys and leaves the
+	// rest of the inner pages to message buffers. subtreeCounts keeps an
+	// unsigned int per child after the child ids of inner nodes, and
+	// aggregateColumn >= 0 a (sum, min, max) summary of that data column
+	// per child after the counts, see AGGREGATE_SUMMARY_SIZE.
+	void Create(const std::string & name, const DataStructure & keyStruct, const DataStructure & dataStruct,
+	            int innerSlots = 0, bool subtreeCounts = false, int aggregateColumn = -1) {
 
 	    Clear();
 
@@ -229,7 +275,7 @@ public:
 
 	    if (CreateHeader( )) {
 
-	        InitHeader(keyStruct, dataStruct);
+	        InitHeader(keyStruct, dataStruct, PAGE_SIZE, innerSlots, subtreeCounts, aggregateColumn);
 
 	    }
 	}
@@ -242,9 +288,16 @@ public:
 	}
 
 	void Clear() {
+	    std::lock_guard<std::recursive_mutex> lock(m_mutex);
 	    m_deletePages.clear();
 	    m_memoryPageCache.clear();
 	    m_header = NULL;
+#ifdef __unix__
+	    if (m_readaheadFD != -1) {
+	        close(m_readaheadFD);
+	        m_readaheadFD = -1;
+	    }
+#endif
 	}
 
 	bool CreateHeader( ) {
@@ -283,7 +336,8 @@ public:
 		return res;
 	}
 
-	bool InitHeader( const DataStructure & keyStruct, const DataStructure & dataStruct, int limit = 65536 ) {
+	bool InitHeader( const DataStructure & keyStruct, const DataStructure & dataStruct, int limit = 65536,
+	                 int innerSlots = 0, bool subtreeCounts = false, int aggregateColumn = -1 ) {
 
 		assert(FileExists( m_headerFile ));
 
@@ -302,6 +356,7 @@ public:
 			m_header->size = 0;
 
 			m_header->nKeyTypes = keyStruct.NTypes();
+			m_header->keyEncoding = keyStruct.IsMemComparable() ? 1 : 0;
 			m_header->nDataTypes = dataStruct.NTypes();
 
 			m_header->dataSize = 0;
@@ -321,8 +376,45 @@ public:
 
 
 
+			// inner nodes keep one more child id than keys, so one int is
+			// reserved, and the high key of the node is the last key of the
+			// page
 			m_header->memPageSize = limit;
-			m_header->nSlots = (limit - sizeof(MemoryPage)) / ( m_header->keySize + std::max(m_header->dataSize, (int)sizeof(int)));
+			m_header->nSlots = (limit - sizeof(MemoryPage) - sizeof(int) - m_header->keySize) / ( m_header->keySize + std::max(m_header->dataSize, (int)sizeof(int)));
+			m_header->linkEpoch = 0;
+
+			// subtree counts and aggregates follow the child ids and take
+			// key slots from the inner nodes. Aggregates are kept with
+			// counts, so that empty subtrees are known.
+			if (aggregateColumn >= m_header->nDataTypes
+			        || (aggregateColumn >= 0 && dataStruct.GetType(aggregateColumn) == t_string_type))
+			    aggregateColumn = -1;
+
+			m_header->innerSlots = m_header->nSlots;
+			m_header->aggregateColumn = aggregateColumn + 1;
+			m_header->subtreeCounts = subtreeCounts || aggregateColumn >= 0 ? 1 : 0;
+
+			int childBytes = sizeof(int);
+			if (m_header->subtreeCounts)
+			    childBytes += sizeof(unsigned int);
+			if (aggregateColumn >= 0)
+			    childBytes += AGGREGATE_SUMMARY_SIZE;
+
+			if (childBytes > (int) sizeof(int)) {
+			    int fit = (limit - sizeof(MemoryPage) - childBytes - m_header->keySize) / (m_header->keySize + childBytes);
+			    m_header->innerSlots = std::min(m_header->nSlots, fit);
+			}
+
+			// a message buffer follows the child ids (and counts): its
+			// count, then (type, key, data) records
+			m_header->bufferSlots = 0;
+			m_header->pendingMessages = 0;
+
+			if (innerSlots > 0 && innerSlots < m_header->innerSlots) {
+			    int used = sizeof(MemoryPage) + (innerSlots + 1) * (m_header->keySize + childBytes) + sizeof(int);
+			    m_header->innerSlots = innerSlots;
+			    m_header->bufferSlots = (limit - used) / (1 + m_header->keySize + m_header->dataSize);
+			}
 
 			CloseHeaderMap( );
 
@@ -357,6 +449,7 @@ public:
 
 		if (res) {
 		    m_keyType = DataStructure(m_header->nKeyTypes, &m_header->key_type[0], &m_header->key_sizes[0]);
+		    m_keyType.SetMemComparable(m_header->keyEncoding != 0);
 		    m_dataType = DataStructure(m_header->nDataTypes, &m_header->data_type[0], &m_header->data_sizes[0]);
 		}
 
@@ -378,6 +471,8 @@ public:
 
 	MemoryNode InsertPage( ) {
 
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
 		MemoryNode page;
 
 		int nPage = 0;
@@ -396,11 +491,10 @@ public:
 
 			nPage = m_header->nPages;
 
-			int siz = m_header->size + PAGE_SIZE;
-
-			ResizeFile(m_fileName, siz);
+			if (!ReservePages(1)) {
+				return page;
+			}
 
-			m_header->size = siz;
 			m_header->nPages++;
 			m_header->usedPages++;
 
@@ -416,12 +510,89 @@ public:
 
 	}
 
+	// Always takes a new page at the end of the file, ignoring the free
+	// list, so that consecutive calls return consecutive pages. Used by the
+	// bulk loader to lay out leaves sequentially.
+	MemoryNode AppendPage( ) {
+
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+		int nPage = m_header->nPages;
+
+		if (!ReservePages(1)) {
+			return MemoryNode();
+		}
+
+		m_header->nPages++;
+		m_header->usedPages++;
+
+		MemoryNode page = GetMemoryPage(nPage);
+
+		page->isInit = true;
+		page->id = nPage;
+
+		activePage = nPage;
+
+		return page;
+	}
+
+	// Take n consecutive pages at the end of the file at once and return the
+	// id of the first, -1 if the file can't grow. The pages are neither
+	// mapped nor initialised; the caller fills them through GetMemoryPage(),
+	// possibly from several threads, as they don't share anything.
+	int AppendPages(size_t n) {
+
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+		int nPage = m_header->nPages;
+
+		if (!ReservePages(n)) {
+			return -1;
+		}
+
+		m_header->nPages += n;
+		m_header->usedPages += n;
+
+		activePage = nPage + n - 1;
+
+		return nPage;
+	}
+
+	// Make sure the file can hold n more pages than are in use. The file is
+	// grown geometrically, so appending pages one by one doesn't reopen and
+	// extend the file on every call. Page ids are int, so false if the file
+	// would pass INT_MAX pages.
+	bool ReservePages(size_t n) {
+
+		if (n > (size_t) INT_MAX - m_header->nPages) {
+			return false;
+		}
+
+		off_t needed = ((off_t) m_header->nPages + (off_t) n) * PAGE_SIZE;
+
+		if (needed <= m_header->size) {
+			return true;
+		}
+
+		off_t siz = std::max(needed, m_header->size + std::min(m_header->size, (off_t) 1024 * PAGE_SIZE));
+
+		bool res = ResizeFile(m_fileName, siz);
+
+		if (res) {
+			m_header->size = siz;
+		}
+
+		return res;
+	}
+
 	MemoryNode GetPage(int n) {
 		return GetMemoryPage(n);
 	}
 
 	bool DeletePage(int n) {
 
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
 		if (n < m_header->nPages && m_deletePages.find(n) == m_deletePages.end()) {
 			MemoryNode page = GetMemoryPage(n);
 			page->isInit = false;
@@ -430,6 +601,49 @@ public:
 		return true;
 	}
 
+	// Write back the image of page n that a transaction saved. The page may
+	// be free now, or may have been free when it was saved. The version
+	// stays, it belongs to the latches and not to the content.
+	void RestorePage(int n, const char * image) {
+
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+		m_deletePages.erase(n);
+
+		MemoryNode page = GetMemoryPage(n);
+		if (!page) {
+			return;
+		}
+
+		unsigned int version = page->version;
+		memcpy(page.getData(), image, m_header->memPageSize);
+		page->version = version;
+
+		if (!page->isInit) {
+			m_deletePages.insert(n);
+		}
+	}
+
+	// Roll the page counts, root and leaf ids back to a header that a
+	// transaction saved. Pages added since are dropped.
+	void RestoreHeader(const MemoryHeader & saved) {
+
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+		m_header->nPages = saved.nPages;
+		m_header->usedPages = saved.usedPages;
+		m_header->rootPage = saved.rootPage;
+		m_header->headLeaf = saved.headLeaf;
+		m_header->tailLeaf = saved.tailLeaf;
+		m_header->pendingMessages = saved.pendingMessages;
+
+		m_deletePages.erase(m_deletePages.lower_bound(saved.nPages), m_deletePages.end());
+	}
+
+	const MemoryHeader & GetHeader() const {
+	    return *m_header;
+	}
+
 	bool OpenHeaderMap( ) {
 
 	    bool res = false;
@@ -485,42 +699,102 @@ public:
 
     }
 
+	// Pages can be mapped from several threads. The cache holds a weak
+	// reference to each mapping; a mapping whose last handle is being
+	// released is not revived but replaced by a new one. The mapping, which
+	// reads the page, is made outside the lock so that threads fault their
+	// pages in parallel; if another thread cached the page meanwhile, its
+	// mapping is used and this one dropped.
 	MemoryNode GetMemoryPage(int n) {
 
 		MemoryNode nd;
 
-		if (n >= 0 && n < m_header->nPages && m_deletePages.find(n) == m_deletePages.end()) {
-
-			if (m_memoryPageCache.find(n) != m_memoryPageCache.end()) {
-				nd = m_memoryPageCache[n];
-			}
-			else {
 #ifdef __unix__
-			    mmap_params fileParams;
+		mmap_params fileParams;
 
-			    fileParams.size = PAGE_SIZE;
-			    fileParams.offset = n*PAGE_SIZE;
-			    fileParams.path = m_fileName;
+		fileParams.size = PAGE_SIZE;
+		fileParams.offset = (off_t) n * PAGE_SIZE;
+		fileParams.path = m_fileName;
 #else
-				boost::iostreams::mapped_file_params fileParams;
+		boost::iostreams::mapped_file_params fileParams;
 
-				fileParams.path = m_fileName;
-				fileParams.flags = boost::iostreams::mapped_file_base::readwrite;
-				fileParams.length = PAGE_SIZE;
-				fileParams.offset = n*PAGE_SIZE;
+		fileParams.path = m_fileName;
+		fileParams.flags = boost::iostreams::mapped_file_base::readwrite;
+		fileParams.length = PAGE_SIZE;
+		fileParams.offset = (off_t) n * PAGE_SIZE;
 #endif
 
-				nd = MemoryNode(this, fileParams);
-
-				m_memoryPageCache[n] = nd;
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
 
-				(*nd.m_memNodeImpl).m_count--;
+			if (n < 0 || n >= m_header->nPages || m_deletePages.find(n) != m_deletePages.end()) {
+				return nd;
+			}
 
+			if (CachedPage(n, nd)) {
+				return nd;
 			}
 		}
-		
-		return nd;
 
+		MemoryNode mapped(this, fileParams);
+
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+		if (CachedPage(n, nd)) {
+			return nd;
+		}
+
+		m_memoryPageCache[n] = mapped;
+
+		(*mapped.m_memNodeImpl).m_count--;
+
+		return mapped;
+
+	}
+
+	// Reference the cached mapping of page n, false if there is none or it
+	// is being released. Called with m_mutex held.
+	bool CachedPage(int n, MemoryNode & nd) {
+		std::map<int, MemoryNode>::iterator it = m_memoryPageCache.find(n);
+
+		if (it != m_memoryPageCache.end() && it->second.m_memNodeImpl->TryAddRef()) {
+			nd.m_memNodeImpl = it->second.m_memNodeImpl;
+			return true;
+		}
+		return false;
+	}
+
+	// Ask the kernel to read pages into the page cache ahead of their
+	// mapping, for scans that know which pages come next. Runs of adjacent
+	// pages are advised as one range.
+	void WillNeed(std::vector<int> & pages) {
+#ifdef __unix__
+	    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+	    if (pages.empty() || m_header == NULL) {
+	        return;
+	    }
+
+	    if (m_readaheadFD == -1) {
+	        m_readaheadFD = open(m_fileName.c_str(), O_RDONLY);
+	        if (m_readaheadFD == -1) {
+	            return;
+	        }
+	    }
+
+	    std::sort(pages.begin(), pages.end());
+
+	    for (size_t i = 0; i < pages.size(); ) {
+	        size_t j = i + 1;
+	        while (j < pages.size() && pages[j] <= pages[j - 1] + 1) {
+	            j++;
+	        }
+
+	        posix_fadvise(m_readaheadFD, (off_t) pages[i] * PAGE_SIZE,
+	                      (off_t) (pages[j - 1] - pages[i] + 1) * PAGE_SIZE, POSIX_FADV_WILLNEED);
+	        i = j;
+	    }
+#endif
 	}
 
 	int GetRootId( ) {
@@ -565,15 +839,56 @@ public:
 		}
 	}
 
-	void DeleteFromCache(int id) {
-		assert(m_memoryPageCache.find(id) != m_memoryPageCache.end());
-		m_memoryPageCache.erase(m_memoryPageCache.find(id));
+	void DeleteFromCache(int id, MemoryNodeImpl * impl) {
+
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+		std::map<int, MemoryNode>::iterator it = m_memoryPageCache.find(id);
+		if (it != m_memoryPageCache.end() && it->second.m_memNodeImpl == impl) {
+			m_memoryPageCache.erase(it);
+		}
 	}
 
 	int GetNSlots() const {
 	    return m_header->nSlots;
 	}
 
+	int GetInnerSlots() const {
+	    return m_header->innerSlots > 0 ? m_header->innerSlots : m_header->nSlots;
+	}
+
+	bool HasSubtreeCounts() const {
+	    return m_header->subtreeCounts != 0;
+	}
+
+	/// The data column inner nodes summarise per child, -1 for none
+	int GetAggregateColumn() const {
+	    return m_header->aggregateColumn - 1;
+	}
+
+	int GetBufferSlots() const {
+	    return m_header->bufferSlots;
+	}
+
+	int GetPendingMessages() const {
+	    return m_header->pendingMessages;
+	}
+
+	void AddPendingMessages(int n) {
+	    m_header->pendingMessages += n;
+	}
+
+	size_t GetPageSize() const {
+	    return m_header->memPageSize;
+	}
+
+	/// A link epoch that no page of the file carries yet
+	unsigned int NextLinkEpoch() {
+	    return ++m_header->linkEpoch;
+	}
+
+	const std::string & FileName() const { return m_fileName; }
+
 	size_t KeySize() { return m_header->keySize; }
 
 	size_t DataSize() { return m_header->dataSize; }
@@ -595,6 +910,7 @@ private:
 #ifdef __unix__
 	const int PAGE_SIZE = 0x1000;
 	int m_headerFD;
+	int m_readaheadFD;	// read only descriptor of the pages for WillNeed()
 #else
 	boost::iostreams::mapped_file m_headerFileMap;
 	const int PAGE_SIZE = boost::iostreams::mapped_file::alignment();
@@ -606,4 +922,8 @@ private:
 
 	std::map<int, MemoryNode > m_memoryPageCache;
 
+	// guards the page cache and the free list, pages are mapped, allocated
+	// and deleted from several threads
+	std::recursive_mutex m_mutex;
+
 };
@@ -8,8 +8,14 @@
 #ifndef SRC_DATA_STRUCTURES_H_
 #define SRC_DATA_STRUCTURES_H_
 
+#include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <new>
 
 enum t_dataTypes {
     t_short_type = 0,
@@ -31,15 +37,77 @@ public:
         buf[n] = '\0';
     }
     char operator[](int i) const {
-        return buf[i];
+        return ((const char*)(((const VariantString*)this)+1))[i];
     }
     size_t size() const { return n; }
-    char * data() { return buf; }
+    // The characters follow the object itself, so the address is recomputed
+    // instead of trusting buf, which is stale once the page is mapped again.
+    char * data() { return (char*)(((VariantString*)this)+1); }
 private:
     size_t n;
     char * buf;
 };
 
+// Order preserving ("memcomparable") encoding of key columns. Encoded keys
+// compare with a single memcmp over the whole key, whatever the schema:
+//  - integers are stored big-endian with the sign bit flipped,
+//  - doubles flip the sign bit when positive and all bits when negative,
+//    then are stored big-endian,
+//  - bools are one byte, 0 or 1,
+//  - strings are NUL terminated and zero padded to the column size.
+class KeyEncoding {
+public:
+
+    static void EncodeInt(char * dst, long long val, size_t size) {
+        unsigned long long u = (unsigned long long) val;
+        u ^= 1ULL << (size*8 - 1);
+        for (size_t i=0; i<size; i++) {
+            dst[size - 1 - i] = (char) (u >> (i*8));
+        }
+    }
+
+    static long long DecodeInt(const char * src, size_t size) {
+        unsigned long long u = 0;
+        for (size_t i=0; i<size; i++) {
+            u = (u << 8) | (unsigned char) src[i];
+        }
+        u ^= 1ULL << (size*8 - 1);
+        // sign extend the narrower types
+        int shift = 64 - (int)size*8;
+        return ((long long) (u << shift)) >> shift;
+    }
+
+    static void EncodeDouble(char * dst, double val) {
+        unsigned long long u;
+        memcpy(&u, &val, sizeof(u));
+        u = (u >> 63) ? ~u : (u | (1ULL << 63));
+        for (size_t i=0; i<sizeof(u); i++) {
+            dst[sizeof(u) - 1 - i] = (char) (u >> (i*8));
+        }
+    }
+
+    static double DecodeDouble(const char * src) {
+        unsigned long long u = 0;
+        for (size_t i=0; i<sizeof(u); i++) {
+            u = (u << 8) | (unsigned char) src[i];
+        }
+        u = (u >> 63) ? (u & ~(1ULL << 63)) : ~u;
+        double val;
+        memcpy(&val, &u, sizeof(val));
+        return val;
+    }
+
+    static void EncodeString(char * dst, const std::string & val, size_t size) {
+        size_t n = std::min(strlen(val.c_str()), size - 1);
+        memcpy(dst, val.c_str(), n);
+        memset(dst + n, 0, size - n);
+    }
+
+    static std::string DecodeString(const char * src, size_t size) {
+        return std::string(src, strnlen(src, size));
+    }
+};
+
 class CVariant {
 public:
 
@@ -181,7 +249,7 @@ public:
                 }
             }
 
-            return false;
+            return lhs->size() != rhs->size();
         }
             break;
         default:
@@ -261,10 +329,55 @@ public:
             *(bool *) m_data = atoi(data.c_str());
         }
         else {
-            *(VariantString *) m_data = VariantString(data);
+            new (m_data) VariantString(data);
         }
     }
 
+    // Same as SetData(), but writes the memcomparable key encoding
+    void SetNormalized(const std::string & data) {
+
+        char * dst = (char *) m_data;
+
+        if (m_type == t_int_type || m_type == t_short_type || m_type == t_longlong_type) {
+            KeyEncoding::EncodeInt(dst, atoll(data.c_str()), m_size);
+        }
+        else if (m_type == t_double_type) {
+            KeyEncoding::EncodeDouble(dst, atof(data.c_str()));
+        }
+        else if (m_type == t_bool_type) {
+            *dst = atoi(data.c_str()) != 0;
+        }
+        else {
+            KeyEncoding::EncodeString(dst, data, m_size);
+        }
+    }
+
+    std::string ToString(bool normalized) const {
+
+        const char * src = (const char *) m_data;
+
+        switch (m_type) {
+        case t_short_type:
+        case t_int_type:
+        case t_longlong_type:
+            if (normalized) {
+                return std::to_string(KeyEncoding::DecodeInt(src, m_size));
+            }
+            if (m_type == t_short_type) return std::to_string((short)(*this));
+            if (m_type == t_int_type) return std::to_string((int)(*this));
+            return std::to_string((long long)(*this));
+        case t_double_type:
+            return std::to_string(normalized ? KeyEncoding::DecodeDouble(src) : (double)(*this));
+        case t_bool_type:
+            return std::to_string((int)(*src != 0));
+        case t_string_type:
+            return normalized ? KeyEncoding::DecodeString(src, m_size) : (std::string)(*this);
+        default:
+            break;
+        }
+        return "";
+    }
+
 private:
     t_dataTypes m_type;
     size_t m_size;
@@ -281,6 +394,8 @@ public:
 
         memcpy(types, _types, n*sizeof(t_dataTypes));
         memcpy(sizes, _sizes, n*sizeof(size_t));
+
+        memcomparable = false;
     }
     DataStructure(std::vector<std::string> & _types) {
         n = _types.size();
@@ -291,6 +406,8 @@ public:
             types[i] = CVariant::GetType(_types[i]);
             sizes[i] = CVariant::GetSize(_types[i]);
         }
+
+        memcomparable = false;
     }
     DataStructure(std::vector<std::string> _types) {
         n = _types.size();
@@ -301,12 +418,15 @@ public:
             types[i] = CVariant::GetType(_types[i]);
             sizes[i] = CVariant::GetSize(_types[i]);
         }
+
+        memcomparable = false;
     }
 
     DataStructure() {
         n = 0;
         types = NULL;
         sizes = NULL;
+        memcomparable = false;
     }
 
     ~DataStructure() {
@@ -328,6 +448,8 @@ public:
 
             memcpy(types, other.types, n*sizeof(t_dataTypes));
             memcpy(sizes, other.sizes, n*sizeof(size_t));
+
+            memcomparable = other.memcomparable;
         }
         return *this;
     }
@@ -339,6 +461,8 @@ public:
 
         memcpy(types, other.types, n*sizeof(t_dataTypes));
         memcpy(sizes, other.sizes, n*sizeof(size_t));
+
+        memcomparable = other.memcomparable;
     }
 
     int NTypes() const { return n; }
@@ -347,7 +471,7 @@ public:
 
     size_t GetTypeSize(int i) const { return sizes[i]; }
 
-    size_t GetSize() {
+    size_t GetSize() const {
         size_t siz = 0;
         for (int i = 0; i<n; i++) {
             siz += sizes[i];
@@ -355,15 +479,32 @@ public:
         return siz;
     }
 
+    // Values of a memcomparable structure are stored in the KeyEncoding
+    // format, so two of them compare with memcmp
+    bool IsMemComparable() const { return memcomparable; }
+
+    void SetMemComparable(bool val) { memcomparable = val; }
+
     void SetData(int idx, char * ptr, std::string & val) {
         CVariant var(ptr, types[idx], sizes[idx]);
-        var.SetData(val);
+        if (memcomparable) {
+            var.SetNormalized(val);
+        }
+        else {
+            var.SetData(val);
+        }
+    }
+
+    std::string GetData(int idx, char * ptr) const {
+        CVariant var(ptr, types[idx], sizes[idx]);
+        return var.ToString(memcomparable);
     }
 
 private:
     int n;
     t_dataTypes * types;
     size_t * sizes;
+    bool memcomparable;
 };
 
 class DataStructure;
@@ -378,17 +519,27 @@ public:
     DataType(const DataType & other) : m_dataStruct(other.m_dataStruct), m_data(other.m_data) {
     }
 
+    DataType & operator=(const DataType & other) {
+        m_dataStruct = other.m_dataStruct;
+        m_data = other.m_data;
+        return *this;
+    }
+
     int NParams() const { return m_dataStruct != NULL ? m_dataStruct->NTypes() : 0; }
 
-    bool operator<(const DataType & other) {
+    bool operator<(const DataType & other) const {
+
+        if (m_dataStruct->IsMemComparable()) {
+            return memcmp(m_data, other.Data(), m_dataStruct->GetSize()) < 0;
+        }
 
         char * cur = m_data;
-        const char * curOther = other.Data();
+        char * curOther = (char *) other.Data();
 
         for (int i=0; i<m_dataStruct->NTypes(); i++) {
 
             CVariant lhs(cur, m_dataStruct->GetType(i), m_dataStruct->GetTypeSize(i));
-            CVariant rhs(cur, m_dataStruct->GetType(i), m_dataStruct->GetTypeSize(i));
+            CVariant rhs(curOther, m_dataStruct->GetType(i), m_dataStruct->GetTypeSize(i));
 
             if (lhs != rhs) {
                 return lhs < rhs;
@@ -402,9 +553,8 @@ public:
         return false;
     }
 
-    bool operator<=(const DataType & other) {
-        // TODO
-        return true;
+    bool operator<=(const DataType & other) const {
+        return !(other < *this);
     }
 
     char * Data() { return m_data; }
@@ -413,7 +563,7 @@ public:
 
     void SetData(char * buf) { m_data = buf; }
 
-    int GetSize() { return m_dataStruct->GetSize(); }
+    int GetSize() const { return m_dataStruct->GetSize(); }
 
     void SetData(int idx, std::string val) {
         size_t cur = 0;
@@ -421,9 +571,129 @@ public:
         m_dataStruct->SetData(idx, m_data+cur, val);
     }
 
+    std::string GetData(int idx) const {
+        size_t cur = 0;
+        for (int i=0; i<idx; i++) cur += m_dataStruct->GetTypeSize(i);
+        return m_dataStruct->GetData(idx, m_data+cur);
+    }
+
 private:
+    friend class DataView;
+
     DataStructure * m_dataStruct;
     char * m_data;
 };
 
+// Read-only typed access to a key or data stored in a page: the columns are
+// read in place, decoding the KeyEncoding of memcomparable structures, and
+// strings are returned as pointers into the page. A view is valid while the
+// page is mapped, like the DataType it is made from.
+class DataView {
+public:
+    DataView() : m_dataStruct(NULL), m_data(NULL) {}
+
+    DataView(const DataStructure * dataStruct, const char * data) : m_dataStruct(dataStruct), m_data(data) {}
+
+    DataView(const DataType & other) : m_dataStruct(other.m_dataStruct), m_data(other.m_data) {}
+
+    int NParams() const { return m_dataStruct != NULL ? m_dataStruct->NTypes() : 0; }
+
+    const char * Data() const { return m_data; }
+
+    int GetSize() const { return m_dataStruct->GetSize(); }
+
+    /// SHORT, INT or INT64 column idx
+    long long GetInt(int idx) const {
+        const char * p = m_data + Offset(idx);
+        size_t size = m_dataStruct->GetTypeSize(idx);
+
+        if (m_dataStruct->IsMemComparable()) {
+            return KeyEncoding::DecodeInt(p, size);
+        }
+
+        if (size == sizeof(short)) {
+            short v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+        if (size == sizeof(int)) {
+            int v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+        long long v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    double GetDouble(int idx) const {
+        const char * p = m_data + Offset(idx);
+
+        if (m_dataStruct->IsMemComparable()) {
+            return KeyEncoding::DecodeDouble(p);
+        }
+        double v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    bool GetBool(int idx) const { return m_data[Offset(idx)] != 0; }
+
+    /// The characters of STRING column idx in the page, len of them. They
+    /// are NUL terminated.
+    const char * GetString(int idx, size_t & len) const {
+        const char * p = m_data + Offset(idx);
+
+        if (m_dataStruct->IsMemComparable()) {
+            len = strnlen(p, m_dataStruct->GetTypeSize(idx));
+            return p;
+        }
+        len = ((const VariantString *) p)->size() - 1;
+        return p + sizeof(VariantString);
+    }
+
+    /// Append the columns as INSERT takes them: "(1 2.500000 abc)"
+    void AppendTo(std::string & out) const {
+        char buf[32];
+
+        out += '(';
+        for (int i=0; i<NParams(); i++) {
+            if (i) out += ' ';
+
+            switch (m_dataStruct->GetType(i)) {
+            case t_short_type:
+            case t_int_type:
+            case t_longlong_type:
+                out.append(buf, snprintf(buf, sizeof(buf), "%lld", GetInt(i)));
+                break;
+            case t_double_type:
+                out.append(buf, snprintf(buf, sizeof(buf), "%f", GetDouble(i)));
+                break;
+            case t_bool_type:
+                out += GetBool(i) ? '1' : '0';
+                break;
+            case t_string_type: {
+                size_t len;
+                const char * str = GetString(i, len);
+                out.append(str, len);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        out += ')';
+    }
+
+private:
+    size_t Offset(int idx) const {
+        size_t cur = 0;
+        for (int i=0; i<idx; i++) cur += m_dataStruct->GetTypeSize(i);
+        return cur;
+    }
+
+    const DataStructure * m_dataStruct;
+    const char * m_data;
+};
+
 #endif /* SRC_DATA_STRUCTURES_H_ */
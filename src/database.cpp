@@ -4,8 +4,14 @@
  * query strings:
  *  - Create new table: CREATE table_name (key_types) (data_types)
  *    Types: INT, LONGLONG, DOUBLE, BOOL, STRING[SIZE]
+ *    Not inside a transaction, the new file couldn't be rolled back
  *
  *  - Insert: INSERT table_name (key) (data)
+ *
+ *  - Lookup: GET table_name (key), answers the data as (value value ...)
+ *
+ *  - Transactions: BEGIN, COMMIT, ROLLBACK, SAVEPOINT name, RELEASE name,
+ *    ROLLBACK TO name
  */
 std::string Database::query(std::string q) {
 
@@ -23,11 +29,13 @@ std::string Database::query(std::string q) {
             std::string keyStr = parser.next();
             std::string dataStr = parser.next();
 
-            if (name != "" && keyStr != "" && dataStr != "") {
+            if (name != "" && keyStr != "" && dataStr != "" && !m_transaction) {
 
                 StringParser keyParser(keyStr);
                 StringParser dataParser(dataStr);
 
+                m_tables.erase(name);
+
                 PersistentBTree tree;
                 DataStructure keySt(keyParser.tokenize());
                 DataStructure dataSt(dataParser.tokenize());
@@ -40,13 +48,12 @@ std::string Database::query(std::string q) {
 
             std::string name = parser.next();
 
-            PersistentBTree tree;
-            tree.open(name);
+            PersistentBTree * tree = table(name);
 
-            if (tree.is_open())
+            if (tree != NULL)
             {
-                DataType key = DataType(tree.GetKeyStructure(), NULL);
-                DataType data = DataType(tree.GetDataStructure(), NULL);
+                DataType key = DataType(tree->GetKeyStructure(), NULL);
+                DataType data = DataType(tree->GetDataStructure(), NULL);
 
                 char * keyBuf = new char[key.GetSize()];
                 char * dataBuf = new char[data.GetSize()];
@@ -64,32 +71,31 @@ std::string Database::query(std::string q) {
 
                     int i = 0;
                     while (keyParser.hasNext()) {
-                        key.SetData(i, keyParser.next());
+                        key.SetData(i++, keyParser.next());
                     }
 
                     i = 0;
                     while (dataParser.hasNext()) {
-                        data.SetData(i, dataParser.next());
+                        data.SetData(i++, dataParser.next());
                     }
 
-                    tree.insert(key, data);
+                    tree->insert(key, data);
 
                 }
 
-                delete keyBuf;
-                delete dataBuf;
+                delete[] keyBuf;
+                delete[] dataBuf;
             }
         }
         else if (type == "GET") {
 
             std::string name = parser.next();
 
-            PersistentBTree tree;
-            tree.open(name);
+            PersistentBTree * tree = table(name);
 
-            if (tree.is_open())
+            if (tree != NULL)
             {
-                DataType key = DataType(tree.GetKeyStructure(), NULL);
+                DataType key = DataType(tree->GetKeyStructure(), NULL);
 
                 char * keyBuf = new char[key.GetSize()];
 
@@ -103,20 +109,204 @@ std::string Database::query(std::string q) {
 
                     int i = 0;
                     while (keyParser.hasNext()) {
-                        key.SetData(i, keyParser.next());
+                        key.SetData(i++, keyParser.next());
                     }
 
-                    DataType data = tree.find(key).data();
+                    // the data is written straight from the page
+                    PersistentBTree::iterator it = tree->find(key);
+                    if (it != tree->End()) {
+                        it.data_view().AppendTo(res);
+                    }
 
                 }
 
-                delete keyBuf;
+                delete[] keyBuf;
             }
         }
+        else if (type == "BEGIN") {
+            begin();
+        }
+        else if (type == "COMMIT") {
+            commit();
+        }
+        else if (type == "ROLLBACK") {
+            if (to_upper(parser.next()) == "TO") {
+                rollback_to(parser.next());
+            }
+            else {
+                rollback();
+            }
+        }
+        else if (type == "SAVEPOINT") {
+            savepoint(parser.next());
+        }
+        else if (type == "RELEASE") {
+            release(parser.next());
+        }
     }
 
     return res;
 
 }
 
+PersistentBTree * Database::table(const std::string & name) {
+
+    std::map<std::string, std::unique_ptr<PersistentBTree> >::iterator it = m_tables.find(name);
+    if (it != m_tables.end()) {
+        return it->second.get();
+    }
+
+    std::unique_ptr<PersistentBTree> tree(new PersistentBTree());
+    tree->open(name);
+
+    if (!tree->is_open()) {
+        return NULL;
+    }
+
+    // without its journal the table's writes couldn't be rolled back
+    if (m_transaction) {
+        if (!tree->begin()) {
+            return NULL;
+        }
+        for (size_t i = 0; i < m_savepoints.size(); i++) {
+            tree->savepoint();
+        }
+    }
+
+    PersistentBTree * res = tree.get();
+    m_tables[name] = std::move(tree);
+
+    return res;
+}
+
+bool Database::begin() {
+
+    if (m_transaction) {
+        return false;
+    }
+
+    std::map<std::string, std::unique_ptr<PersistentBTree> >::iterator it;
+
+    for (it = m_tables.begin(); it != m_tables.end(); ++it) {
+        if (!it->second->begin()) {
+            // undo the tables that did begin
+            for (std::map<std::string, std::unique_ptr<PersistentBTree> >::iterator jt = m_tables.begin(); jt != it; ++jt) {
+                jt->second->rollback();
+            }
+            return false;
+        }
+    }
+
+    m_transaction = true;
+    m_failed = false;
+    return true;
+}
+
+bool Database::commit() {
+
+    if (!m_transaction) {
+        return false;
+    }
+
+    // if a table couldn't write its journal, none of them commits
+    std::map<std::string, std::unique_ptr<PersistentBTree> >::iterator it;
+    for (it = m_tables.begin(); it != m_tables.end() && !m_failed; ++it) {
+        m_failed = it->second->transaction_failed();
+    }
+
+    if (m_failed) {
+        rollback();
+        return false;
+    }
+
+    for (it = m_tables.begin(); it != m_tables.end(); ++it) {
+        it->second->commit();
+    }
+
+    m_transaction = false;
+    m_savepoints.clear();
+    return true;
+}
+
+bool Database::rollback() {
+
+    if (!m_transaction) {
+        return false;
+    }
+
+    std::map<std::string, std::unique_ptr<PersistentBTree> >::iterator it;
+    for (it = m_tables.begin(); it != m_tables.end(); ++it) {
+        it->second->rollback();
+    }
+
+    m_transaction = false;
+    m_savepoints.clear();
+    return true;
+}
+
+bool Database::savepoint(const std::string & name) {
+
+    if (name == "" || (!m_transaction && !begin())) {
+        return false;
+    }
+
+    // level m_savepoints.size() + 1 of the tables, see release()
+    std::map<std::string, std::unique_ptr<PersistentBTree> >::iterator it;
+    for (it = m_tables.begin(); it != m_tables.end(); ++it) {
+        if (it->second->savepoint() != m_savepoints.size() + 1) {
+            m_failed = true;
+        }
+    }
+
+    m_savepoints.push_back(name);
+    return true;
+}
+
+bool Database::release(const std::string & name) {
+
+    int idx = FindSavepoint(name);
+    if (idx < 0) {
+        return false;
+    }
+
+    // savepoint idx is level idx + 1 of the tables, level 0 is begin()
+    std::map<std::string, std::unique_ptr<PersistentBTree> >::iterator it;
+    for (it = m_tables.begin(); it != m_tables.end(); ++it) {
+        if (!it->second->release(idx + 1)) {
+            m_failed = true;
+        }
+    }
+
+    m_savepoints.resize(idx);
+    return true;
+}
+
+bool Database::rollback_to(const std::string & name) {
+
+    int idx = FindSavepoint(name);
+    if (idx < 0) {
+        return false;
+    }
+
+    std::map<std::string, std::unique_ptr<PersistentBTree> >::iterator it;
+    for (it = m_tables.begin(); it != m_tables.end(); ++it) {
+        if (!it->second->rollback_to(idx + 1)) {
+            m_failed = true;
+        }
+    }
+
+    m_savepoints.resize(idx + 1);
+    return true;
+}
+
+int Database::FindSavepoint(const std::string & name) {
+
+    for (int i = (int) m_savepoints.size() - 1; i >= 0; i--) {
+        if (m_savepoints[i] == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 
@@ -2,6 +2,11 @@
 #ifndef SRC_DATABASE_H_
 #define SRC_DATABASE_H_
 
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "string_utils.h"
 #include "persistentbtree.h"
 
@@ -14,7 +19,7 @@ public:
     }
 
 private:
-    Database() {}
+    Database() : m_transaction(false), m_failed(false) {}
 
 public:
     Database(Database const&) = delete;
@@ -22,6 +27,40 @@ public:
 
     std::string query(std::string q);
 
+    /// The table name, opened on first use and kept open. NULL if there is
+    /// no such table. A table opened during a transaction joins it.
+    PersistentBTree * table(const std::string & name);
+
+    /// A transaction spans all open tables, see PersistentBTree::begin().
+    /// The tables commit one after the other: the changes are atomic for
+    /// the process, a crash during commit() can leave some of the tables
+    /// rolled back by their journal. If a table couldn't write its
+    /// journal, or its savepoints got out of step with the others, commit()
+    /// rolls all tables back and returns false.
+    bool begin();
+    bool commit();
+    bool rollback();
+
+    /// Named savepoints, as in SQL. release() and rollback_to() take the
+    /// newest savepoint of that name. A savepoint outside a transaction
+    /// begins one.
+    bool savepoint(const std::string & name);
+    bool release(const std::string & name);
+    bool rollback_to(const std::string & name);
+
+private:
+
+    /// Index of the newest savepoint called name, -1 if there is none
+    int FindSavepoint(const std::string & name);
+
+    std::map<std::string, std::unique_ptr<PersistentBTree> > m_tables;
+
+    bool m_transaction;
+    std::vector<std::string> m_savepoints;
+
+    // a table's savepoints no longer match m_savepoints, commit() fails
+    bool m_failed;
+
 };
 
 
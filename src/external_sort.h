@@ -0,0 +1,225 @@
+/*
+ * external_sort.h
+ *
+ * Sorts fixed size (key, data) records by key with bounded memory. Records
+ * are collected in a run buffer; when the buffer is full it is sorted and
+ * spilled to a temporary file. Finish() sorts the last run and Next() then
+ * streams all records back in key order, merging the runs with a heap.
+ */
+
+#ifndef SRC_EXTERNAL_SORT_H_
+#define SRC_EXTERNAL_SORT_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+
+#include "data_structures.h"
+
+class ExternalSorter {
+public:
+
+    ExternalSorter(DataStructure * keyStruct, size_t keySize, size_t dataSize,
+                   size_t memoryLimit, const std::string & tmpPrefix)
+        : m_keyStruct(keyStruct), m_keySize(keySize), m_dataSize(dataSize),
+          m_recordSize(keySize + dataSize), m_tmpPrefix(tmpPrefix),
+          m_finished(false), m_memPos(0) {
+
+        m_runRecords = std::max((size_t)1, memoryLimit / std::max((size_t)1, m_recordSize));
+    }
+
+    ~ExternalSorter() {
+        for (size_t i=0; i<m_runs.size(); i++) {
+            if (m_runs[i].file != NULL) {
+                fclose(m_runs[i].file);
+            }
+            remove(m_runs[i].path.c_str());
+        }
+    }
+
+    void Add(const char * key, const char * data) {
+
+        assert(!m_finished);
+
+        size_t pos = m_buffer.size();
+        m_buffer.resize(pos + m_recordSize);
+        memcpy(&m_buffer[pos], key, m_keySize);
+        memcpy(&m_buffer[pos + m_keySize], data, m_dataSize);
+
+        if (m_buffer.size() / m_recordSize >= m_runRecords) {
+            SpillRun();
+        }
+    }
+
+    // Sorts the last run. If nothing was spilled the records are served
+    // straight from memory, otherwise the last run is spilled as well and
+    // all runs are merged.
+    bool Finish() {
+
+        m_finished = true;
+
+        if (m_runs.empty()) {
+            SortBuffer(m_order);
+            m_memPos = 0;
+            return true;
+        }
+
+        if (!m_buffer.empty() && !SpillRun()) {
+            return false;
+        }
+
+        for (size_t i=0; i<m_runs.size(); i++) {
+            run & r = m_runs[i];
+            r.file = fopen(r.path.c_str(), "rb");
+            if (r.file == NULL) {
+                return false;
+            }
+            r.record.resize(m_recordSize);
+            if (ReadRecord(r)) {
+                m_heap.push(HeapItem(this, i));
+            }
+        }
+
+        return true;
+    }
+
+    // Returns the next record in key order. The pointers stay valid until
+    // the next call.
+    bool Next(const char ** key, const char ** data) {
+
+        assert(m_finished);
+
+        if (m_runs.empty()) {
+            if (m_memPos >= m_order.size()) {
+                return false;
+            }
+            const char * rec = &m_buffer[m_order[m_memPos++] * m_recordSize];
+            *key = rec;
+            *data = rec + m_keySize;
+            return true;
+        }
+
+        if (m_current.size() != m_recordSize) {
+            m_current.resize(m_recordSize);
+        }
+
+        if (m_heap.empty()) {
+            return false;
+        }
+
+        size_t idx = m_heap.top().run;
+        m_heap.pop();
+
+        run & r = m_runs[idx];
+        memcpy(&m_current[0], &r.record[0], m_recordSize);
+
+        if (ReadRecord(r)) {
+            m_heap.push(HeapItem(this, idx));
+        }
+
+        *key = &m_current[0];
+        *data = &m_current[0] + m_keySize;
+
+        return true;
+    }
+
+    size_t NRuns() const { return m_runs.size(); }
+
+private:
+
+    struct run {
+        std::string path;
+        FILE * file;
+        std::vector<char> record;
+        run() : file(NULL) {}
+    };
+
+    struct HeapItem {
+        ExternalSorter * sorter;
+        size_t run;
+        HeapItem(ExternalSorter * s, size_t r) : sorter(s), run(r) {}
+        // std::priority_queue is a max heap, so the order is reversed. Ties
+        // go to the earlier run, which keeps duplicates in input order.
+        bool operator<(const HeapItem & other) const {
+            const char * a = &sorter->m_runs[run].record[0];
+            const char * b = &sorter->m_runs[other.run].record[0];
+            if (sorter->KeyLess(b, a)) return true;
+            if (sorter->KeyLess(a, b)) return false;
+            return run > other.run;
+        }
+    };
+
+    bool KeyLess(const char * a, const char * b) const {
+        return DataType(m_keyStruct, (char*)a) < DataType(m_keyStruct, (char*)b);
+    }
+
+    struct RecordLess {
+        const ExternalSorter * sorter;
+        const char * base;
+        bool operator()(size_t a, size_t b) const {
+            return sorter->KeyLess(base + a * sorter->m_recordSize, base + b * sorter->m_recordSize);
+        }
+    };
+
+    void SortBuffer(std::vector<size_t> & order) {
+
+        size_t n = m_buffer.size() / m_recordSize;
+
+        order.resize(n);
+        for (size_t i=0; i<n; i++) order[i] = i;
+
+        if (n > 0) {
+            RecordLess less = { this, &m_buffer[0] };
+            std::stable_sort(order.begin(), order.end(), less);
+        }
+    }
+
+    bool SpillRun() {
+
+        std::vector<size_t> order;
+        SortBuffer(order);
+
+        run r;
+        r.path = m_tmpPrefix + ".run" + std::to_string(m_runs.size());
+
+        FILE * f = fopen(r.path.c_str(), "wb");
+        if (f == NULL) {
+            return false;
+        }
+
+        for (size_t i=0; i<order.size(); i++) {
+            fwrite(&m_buffer[order[i] * m_recordSize], 1, m_recordSize, f);
+        }
+        fclose(f);
+
+        m_runs.push_back(r);
+        m_buffer.clear();
+
+        return true;
+    }
+
+    bool ReadRecord(run & r) {
+        return fread(&r.record[0], 1, m_recordSize, r.file) == m_recordSize;
+    }
+
+    DataStructure * m_keyStruct;
+    size_t m_keySize;
+    size_t m_dataSize;
+    size_t m_recordSize;
+    size_t m_runRecords;
+    std::string m_tmpPrefix;
+
+    bool m_finished;
+
+    std::vector<char> m_buffer;
+    std::vector<size_t> m_order;
+    size_t m_memPos;
+
+    std::vector<run> m_runs;
+    std::priority_queue<HeapItem> m_heap;
+    std::vector<char> m_current;
+};
+
+#endif /* SRC_EXTERNAL_SORT_H_ */
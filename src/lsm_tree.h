@@ -0,0 +1,454 @@
+/*
+ * lsm_tree.h
+ *
+ * Write-optimised front end of PersistentBTree. Writes go to a log (WAL) and
+ * to an in-memory btree<> memtable and return without touching the pages of
+ * the tree. When the memtable reaches its size limit it becomes immutable,
+ * a new memtable and log take over, and a background thread applies the
+ * immutable memtable to the tree in key order: data of existing keys is
+ * overwritten in place and the new keys go in with one insert_batch().
+ *
+ * Reads look in the memtable, then in the immutable memtable, then in the
+ * tree. Keys must be memcomparable, which is the default of
+ * PersistentBTree::create(), since the memtable orders them with memcmp.
+ *
+ * The log of the memtable is <name>_wal, the one of the memtable being
+ * applied <name>_wal.old. open() replays both into the tree, so nothing
+ * acknowledged by put() or remove() is lost if the process dies.
+ */
+
+#ifndef SRC_LSM_TREE_H_
+#define SRC_LSM_TREE_H_
+
+#include <stdio.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "btree.h"
+#include "persistentbtree.h"
+
+/// Key of the memtable index: the key bytes of a record in the arena.
+/// btree<> keeps keys in plain arrays, so this is a trivially copyable view.
+/// Keys are memcomparable, memcmp gives the key order.
+struct MemtableKey {
+    const char * key;
+    size_t size;
+
+    bool operator<(const MemtableKey & other) const { return memcmp(key, other.key, size) < 0; }
+
+    bool operator<=(const MemtableKey & other) const { return memcmp(key, other.key, size) <= 0; }
+};
+
+/// Writes not yet applied to the tree. Every write is a log record
+/// [op][key][data] appended to an arena, and a btree<> indexes the latest
+/// record of each key. Overwritten records stay in the arena, so Bytes()
+/// is the memory used, like the log size.
+class Memtable {
+public:
+
+    typedef btree<MemtableKey, const char *> index;
+
+    Memtable(size_t keySize, size_t dataSize)
+        : m_keySize(keySize), m_recordSize(1 + keySize + dataSize), m_used(0), m_bytes(0) {
+    }
+
+    ~Memtable() {
+        for (size_t i=0; i<m_chunks.size(); i++) {
+            delete[] m_chunks[i];
+        }
+    }
+
+    /// Build the record of a write in rec, RecordSize() bytes. data is NULL
+    /// for a remove.
+    void Encode(char * rec, int op, const char * key, const char * data) const {
+        rec[0] = (char) op;
+        memcpy(rec + 1, key, m_keySize);
+        if (data) {
+            memcpy(rec + 1 + m_keySize, data, m_recordSize - 1 - m_keySize);
+        }
+        else {
+            memset(rec + 1 + m_keySize, 0, m_recordSize - 1 - m_keySize);
+        }
+    }
+
+    /// Append a copy of a record and point its key at it
+    const char * Add(const char * record) {
+        if (m_chunks.empty() || m_used + m_recordSize > ChunkSize()) {
+            m_chunks.push_back(new char[ChunkSize()]);
+            m_used = 0;
+        }
+
+        char * rec = m_chunks.back() + m_used;
+        m_used += m_recordSize;
+        m_bytes += m_recordSize;
+
+        memcpy(rec, record, m_recordSize);
+
+        MemtableKey k = { rec + 1, m_keySize };
+        index::iterator it = m_index.find(k);
+        if (it != m_index.End()) {
+            it.data() = rec;
+        }
+        else {
+            m_index.insert(k, rec);
+        }
+        return rec;
+    }
+
+    /// Latest record of key, NULL if the memtable has none
+    const char * Find(const char * key) {
+        MemtableKey k = { key, m_keySize };
+        index::iterator it = m_index.find(k);
+        return it != m_index.End() ? it.data() : NULL;
+    }
+
+    index::iterator Begin() { return m_index.Begin(); }
+
+    index::iterator End() { return m_index.End(); }
+
+    size_t Size() const { return m_index.size(); }
+
+    size_t Bytes() const { return m_bytes; }
+
+    size_t RecordSize() const { return m_recordSize; }
+
+private:
+
+    size_t ChunkSize() const { return std::max((size_t) 64 << 10, m_recordSize); }
+
+    size_t m_keySize;
+    size_t m_recordSize;
+
+    std::vector<char *> m_chunks;
+    size_t m_used;
+    size_t m_bytes;
+
+    index m_index;
+};
+
+class LsmTree {
+public:
+
+    typedef PersistentBTree::key_type key_type;
+    typedef PersistentBTree::data_type data_type;
+
+    LsmTree()
+        : m_keySize(0), m_dataSize(0), m_memtableLimit(0), m_syncWal(false),
+          m_active(NULL), m_immutable(NULL), m_wal(NULL), m_walBytes(0), m_stop(false) {
+    }
+
+    ~LsmTree() {
+        close();
+    }
+
+    /// Create the files of a new table, see PersistentBTree::create()
+    void create(const std::string & name, const DataStructure & keyStruct, const DataStructure & dataStruct) {
+        m_tree.create(name, keyStruct, dataStruct, true);
+    }
+
+    /// Open a table. memtableLimit is the size in bytes of the records the
+    /// memtable takes before it is flushed. With syncWal every write is
+    /// on disk before put() and remove() return, otherwise it is in the page
+    /// cache and survives a crash of the process, not of the machine.
+    bool open(const std::string & name, size_t memtableLimit = 4 << 20, bool syncWal = false) {
+        m_tree.open(name);
+
+        if (!m_tree.is_open() || !m_tree.GetKeyStructure()->IsMemComparable()) {
+            m_tree.clear();
+            return false;
+        }
+
+        m_keySize = m_tree.GetKeyStructure()->GetSize();
+        m_dataSize = m_tree.GetDataStructure()->GetSize();
+        m_memtableLimit = memtableLimit;
+        m_syncWal = syncWal;
+        m_walName = name + "_wal";
+
+        // the logs of a previous run go to the tree before anything else
+        {
+            Memtable recovered(m_keySize, m_dataSize);
+            ReplayWal(m_walName + ".old", recovered);
+            ReplayWal(m_walName, recovered);
+            Apply(recovered);
+        }
+
+        ::remove((m_walName + ".old").c_str());
+
+        m_wal = fopen(m_walName.c_str(), "wb");
+        if (m_wal == NULL) {
+            m_tree.clear();
+            return false;
+        }
+        m_walBytes = 0;
+
+        m_active = new Memtable(m_keySize, m_dataSize);
+        m_record.resize(m_active->RecordSize());
+        m_stop = false;
+        m_worker = std::thread(&LsmTree::FlushLoop, this);
+
+        return true;
+    }
+
+    bool is_open() {
+        return m_active != NULL;
+    }
+
+    /// Apply all writes to the tree and close the table. If the memtable
+    /// can't be handed over, its log stays for the next open() to replay.
+    void close() {
+        if (!is_open()) {
+            return;
+        }
+
+        bool flushed = flush();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        m_worker.join();
+
+        if (m_wal != NULL) {
+            fclose(m_wal);
+            m_wal = NULL;
+        }
+        if (flushed) {
+            ::remove(m_walName.c_str());
+        }
+
+        delete m_active;
+        m_active = NULL;
+
+        m_tree.clear();
+    }
+
+    /// Insert key with data, or overwrite the data if the key exists
+    bool put(const key_type & key, const data_type & data) {
+        return Write(op_put, key.Data(), data.Data());
+    }
+
+    /// Remove key if it exists
+    bool remove(const key_type & key) {
+        return Write(op_erase, key.Data(), NULL);
+    }
+
+    /// Copy the data of key into data, which must have its own storage
+    bool get(const key_type & key, data_type & data) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            Memtable * tables[2] = { m_active, m_immutable };
+            for (int i=0; i<2; i++) {
+                const char * rec = tables[i] ? tables[i]->Find(key.Data()) : NULL;
+                if (rec != NULL) {
+                    if (rec[0] == op_erase) {
+                        return false;
+                    }
+                    memcpy(data.Data(), rec + 1 + m_keySize, m_dataSize);
+                    return true;
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_treeMutex);
+
+        PersistentBTree::iterator it = m_tree.find(key);
+        if (it == m_tree.End()) {
+            return false;
+        }
+        memcpy(data.Data(), it.data().Data(), m_dataSize);
+        return true;
+    }
+
+    /// Apply the memtable to the tree and wait until it is done. Returns
+    /// false if no new log could be started, the memtable then stays.
+    bool flush() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if (m_active->Size() > 0 && !Rotate(lock)) {
+            return false;
+        }
+        m_cond.wait(lock, [this] { return m_immutable == NULL; });
+        return true;
+    }
+
+private:
+
+    enum wal_op {
+        op_put = 1,
+        op_erase = 2
+    };
+
+    /// Log a write, then add it to the memtable. A write that fails leaves
+    /// no trace: get() doesn't see it and it is never applied. A full
+    /// memtable, or one whose log was dropped, is handed over first, so a
+    /// failed rotation fails the write.
+    bool Write(int op, const char * key, const char * data) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if ((m_wal == NULL || m_active->Bytes() >= m_memtableLimit) && !Rotate(lock)) {
+            return false;
+        }
+
+        m_active->Encode(&m_record[0], op, key, data);
+
+        if (fwrite(&m_record[0], m_record.size(), 1, m_wal) != 1 || fflush(m_wal) != 0 ||
+            (m_syncWal && fdatasync(fileno(m_wal)) != 0)) {
+            DropWal();
+            return false;
+        }
+        m_walBytes += m_record.size();
+
+        m_active->Add(&m_record[0]);
+        return true;
+    }
+
+    /// Stop logging after a failed write. Part of its record may have
+    /// reached the log, so the log is cut back to the acknowledged records.
+    /// The next write hands the memtable over and starts a new log.
+    void DropWal() {
+        fclose(m_wal);
+        m_wal = NULL;
+
+        if (truncate(m_walName.c_str(), m_walBytes) != 0) {
+            // replay still ends at a partial record, only a whole record
+            // that made it to disk before the error would be replayed
+        }
+    }
+
+    /// Hand the memtable to the flush thread and start a new one with a new
+    /// log. If the previous memtable is still being applied the writer
+    /// waits for it, which bounds the memory to two memtables. Returns false
+    /// if the new log can't be created; the memtable then keeps its log, or
+    /// if the log can't be moved back either, logging stops.
+    bool Rotate(std::unique_lock<std::mutex> & lock) {
+        m_cond.wait(lock, [this] { return m_immutable == NULL; });
+
+        std::string oldName = m_walName + ".old";
+
+        if (rename(m_walName.c_str(), oldName.c_str()) != 0) {
+            return false;
+        }
+
+        FILE * wal = fopen(m_walName.c_str(), "wb");
+        if (wal == NULL) {
+            if (rename(oldName.c_str(), m_walName.c_str()) != 0 && m_wal != NULL) {
+                // open() replays the log under its old name
+                fclose(m_wal);
+                m_wal = NULL;
+            }
+            return false;
+        }
+
+        if (m_wal != NULL) {
+            fclose(m_wal);
+        }
+        m_wal = wal;
+        m_walBytes = 0;
+
+        m_immutable = m_active;
+        m_active = new Memtable(m_keySize, m_dataSize);
+
+        m_cond.notify_all();
+        return true;
+    }
+
+    void FlushLoop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        for (;;) {
+            m_cond.wait(lock, [this] { return m_stop || m_immutable != NULL; });
+
+            if (m_immutable == NULL) {
+                return;
+            }
+
+            // the immutable memtable is only read from here on, readers
+            // share it under m_mutex
+            lock.unlock();
+            Apply(*m_immutable);
+            lock.lock();
+
+            delete m_immutable;
+            m_immutable = NULL;
+            ::remove((m_walName + ".old").c_str());
+
+            m_cond.notify_all();
+        }
+    }
+
+    /// Apply a memtable to the tree in key order. Removes and updates of
+    /// existing keys are done in place, the new keys are collected and
+    /// inserted with one insert_batch().
+    void Apply(Memtable & table) {
+        std::lock_guard<std::mutex> lock(m_treeMutex);
+
+        std::vector<PersistentBTree::pair_type> batch;
+
+        for (Memtable::index::iterator it = table.Begin(); it != table.End(); ++it) {
+            const char * rec = it.data();
+            key_type key(m_tree.GetKeyStructure(), (char *) rec + 1);
+
+            if (rec[0] == op_erase) {
+                m_tree.erase(key);
+                continue;
+            }
+
+            data_type data(m_tree.GetDataStructure(), (char *) rec + 1 + m_keySize);
+            if (!m_tree.update(key, data)) {
+                batch.push_back(PersistentBTree::pair_type(key, data));
+            }
+        }
+
+        m_tree.insert_batch(batch.begin(), batch.end());
+    }
+
+    /// Read the records of a log into table. A record cut short by a crash
+    /// ends the log.
+    void ReplayWal(const std::string & path, Memtable & table) {
+        FILE * f = fopen(path.c_str(), "rb");
+        if (f == NULL) {
+            return;
+        }
+
+        std::vector<char> rec(table.RecordSize());
+
+        while (fread(&rec[0], rec.size(), 1, f) == 1) {
+            table.Add(&rec[0]);
+        }
+
+        fclose(f);
+    }
+
+    PersistentBTree m_tree;
+
+    size_t m_keySize;
+    size_t m_dataSize;
+    size_t m_memtableLimit;
+    bool m_syncWal;
+    std::string m_walName;
+
+    // m_mutex guards the memtables and the log, m_treeMutex the tree,
+    // which is not thread safe
+    std::mutex m_mutex;
+    std::mutex m_treeMutex;
+    std::condition_variable m_cond;
+
+    Memtable * m_active;
+    Memtable * m_immutable;
+    FILE * m_wal;
+    size_t m_walBytes;
+
+    // the record of the running write, built before it is logged
+    std::vector<char> m_record;
+
+    std::thread m_worker;
+    bool m_stop;
+};
+
+#endif /* SRC_LSM_TREE_H_ */
@@ -0,0 +1,249 @@
+/*
+ * simd_search.h
+ *
+ * Lower/upper bound search in the sorted key array of a node for single
+ * column 32 and 64 bit signed integer keys. The keys are either native
+ * integers (btree<>) or stored in the memcomparable KeyEncoding
+ * (PersistentBTree), which is big-endian with the sign bit flipped.
+ *
+ * A branch-free binary search, or an interpolation from the first and the
+ * last key, narrows the range down to a window, usually two cache lines.
+ * The keys in the window that are less than the search key are then counted
+ * with SSE4.2 or AVX2 compares, chosen at run time from the CPU features.
+ * Other CPUs and compilers use a scalar loop.
+ */
+
+#ifndef SRC_SIMD_SEARCH_H_
+#define SRC_SIMD_SEARCH_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_SEARCH_X86
+#include <immintrin.h>
+#endif
+
+/// True for the key types of btree<> that are searched with SimdSearch
+template <typename Key>
+struct SimdSearchable {
+    static const bool value = std::is_integral<Key>::value && std::is_signed<Key>::value
+            && (sizeof(Key) == 4 || sizeof(Key) == 8);
+};
+
+class SimdSearch {
+public:
+
+    /// How the slot is found
+    enum Method {
+        binary,         // branch-free binary search down to the window
+        interpolation   // guess the window from the first and last key
+    };
+
+    /// First slot in keys[0, n) with a key >= *key. width is 4 or 8 bytes,
+    /// encoded tells whether the keys (and *key) are in the KeyEncoding.
+    /// The last window keys are counted with SIMD compares, a window of n or
+    /// more is a linear scan of the whole node.
+    static int LowerBound(const char * keys, int n, const char * key, int width, bool encoded,
+                          int window, Method method = binary) {
+        return Search(keys, n, Load(key, width, encoded), width, encoded, window, method);
+    }
+
+    /// First slot in keys[0, n) with a key > *key.
+    static int UpperBound(const char * keys, int n, const char * key, int width, bool encoded,
+                          int window, Method method = binary) {
+        int64_t k = Load(key, width, encoded);
+        // no stored key is greater than the maximum, for all others the
+        // upper bound of k is the lower bound of k + 1
+        if (k == (width == 4 ? (int64_t) INT32_MAX : INT64_MAX)) {
+            return n;
+        }
+        return Search(keys, n, k + 1, width, encoded, window, method);
+    }
+
+    /// Default window: two cache lines. Nodes of up to that many keys, as
+    /// in btree<>, are scanned completely.
+    static int DefaultWindow(int width) { return 128 / width; }
+
+    static int64_t Load(const char * p, int width, bool encoded) {
+        if (width == 4) {
+            uint32_t u;
+            memcpy(&u, p, 4);
+            if (encoded) u = Bswap32(u) ^ 0x80000000u;
+            return (int32_t) u;
+        }
+        uint64_t u;
+        memcpy(&u, p, 8);
+        if (encoded) u = Bswap64(u) ^ 0x8000000000000000ull;
+        return (int64_t) u;
+    }
+
+private:
+
+#ifdef __GNUC__
+    static uint32_t Bswap32(uint32_t u) { return __builtin_bswap32(u); }
+    static uint64_t Bswap64(uint64_t u) { return __builtin_bswap64(u); }
+#else
+    static uint32_t Bswap32(uint32_t u) {
+        return (u >> 24) | ((u >> 8) & 0xff00u) | ((u << 8) & 0xff0000u) | (u << 24);
+    }
+    static uint64_t Bswap64(uint64_t u) {
+        return ((uint64_t) Bswap32((uint32_t) u) << 32) | Bswap32((uint32_t) (u >> 32));
+    }
+#endif
+
+    typedef int (*count_fn)(const char * keys, int n, int64_t key, bool encoded);
+
+    static int Search(const char * keys, int n, int64_t key, int width, bool encoded,
+                      int window, Method method) {
+
+        int lo = 0, len = n;
+
+        if (method == interpolation && n > window) {
+            Interpolate(keys, n, key, width, encoded, window, lo, len);
+        }
+
+        // the comparison result selects the half without a branch
+        while (len > window) {
+            int half = len >> 1;
+            bool less = Load(keys + (lo + half) * width, width, encoded) < key;
+            lo = less ? lo + half + 1 : lo;
+            len = less ? len - half - 1 : half;
+        }
+
+        count_fn count = (width == 4) ? Count32() : Count64();
+
+        return lo + count(keys + lo * width, len, key, encoded);
+    }
+
+    /// Narrow [lo, lo + len) to the window around the slot interpolated
+    /// from the first and the last key. If the result is not inside, the
+    /// range is still cut at the window and left to the binary search.
+    static void Interpolate(const char * keys, int n, int64_t key, int width, bool encoded,
+                            int window, int & lo, int & len) {
+
+        int64_t first = Load(keys, width, encoded);
+        int64_t last = Load(keys + (n - 1) * width, width, encoded);
+
+        if (key <= first) {
+            len = 0;
+            return;
+        }
+        if (key > last) {
+            lo = n;
+            len = 0;
+            return;
+        }
+
+        double pos = ((double) key - (double) first) / ((double) last - (double) first) * (n - 1);
+
+        int start = std::max(0, std::min(n - window, (int) pos - window / 2));
+
+        if (start > 0 && Load(keys + (start - 1) * width, width, encoded) >= key) {
+            len = start;
+        }
+        else if (start + window < n && Load(keys + (start + window - 1) * width, width, encoded) < key) {
+            lo = start + window;
+            len = n - lo;
+        }
+        else {
+            lo = start;
+            len = window;
+        }
+    }
+
+    template <int width>
+    static int CountScalar(const char * keys, int n, int64_t key, bool encoded) {
+        int c = 0;
+        for (int i=0; i<n; i++) {
+            c += Load(keys + i * width, width, encoded) < key;
+        }
+        return c;
+    }
+
+#ifdef SIMD_SEARCH_X86
+
+    // pshufb masks reversing the bytes of every 32, resp. 64 bit lane
+    static __m128i Reverse32() { return _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12); }
+    static __m128i Reverse64() { return _mm_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8); }
+
+    __attribute__((target("sse4.2")))
+    static int Count32Sse(const char * keys, int n, int64_t key, bool encoded) {
+        __m128i k = _mm_set1_epi32((int32_t) key);
+        __m128i rev = Reverse32();
+        __m128i sign = _mm_set1_epi32(INT32_MIN);
+        int c = 0, i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (keys + i * 4));
+            if (encoded) v = _mm_xor_si128(_mm_shuffle_epi8(v, rev), sign);
+            c += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, v))));
+        }
+        return c + CountScalar<4>(keys + i * 4, n - i, key, encoded);
+    }
+
+    __attribute__((target("sse4.2")))
+    static int Count64Sse(const char * keys, int n, int64_t key, bool encoded) {
+        __m128i k = _mm_set1_epi64x(key);
+        __m128i rev = Reverse64();
+        __m128i sign = _mm_set1_epi64x(INT64_MIN);
+        int c = 0, i = 0;
+        for (; i + 2 <= n; i += 2) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (keys + i * 8));
+            if (encoded) v = _mm_xor_si128(_mm_shuffle_epi8(v, rev), sign);
+            c += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, v))));
+        }
+        return c + CountScalar<8>(keys + i * 8, n - i, key, encoded);
+    }
+
+    __attribute__((target("avx2")))
+    static int Count32Avx2(const char * keys, int n, int64_t key, bool encoded) {
+        __m256i k = _mm256_set1_epi32((int32_t) key);
+        __m256i rev = _mm256_broadcastsi128_si256(Reverse32());
+        __m256i sign = _mm256_set1_epi32(INT32_MIN);
+        int c = 0, i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (keys + i * 4));
+            if (encoded) v = _mm256_xor_si256(_mm256_shuffle_epi8(v, rev), sign);
+            c += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, v))));
+        }
+        return c + Count32Sse(keys + i * 4, n - i, key, encoded);
+    }
+
+    __attribute__((target("avx2")))
+    static int Count64Avx2(const char * keys, int n, int64_t key, bool encoded) {
+        __m256i k = _mm256_set1_epi64x(key);
+        __m256i rev = _mm256_broadcastsi128_si256(Reverse64());
+        __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+        int c = 0, i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (keys + i * 8));
+            if (encoded) v = _mm256_xor_si256(_mm256_shuffle_epi8(v, rev), sign);
+            c += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, v))));
+        }
+        return c + Count64Sse(keys + i * 8, n - i, key, encoded);
+    }
+
+    static count_fn Count32() {
+        static const count_fn fn = __builtin_cpu_supports("avx2") ? &Count32Avx2
+                : __builtin_cpu_supports("sse4.2") ? &Count32Sse : &CountScalar<4>;
+        return fn;
+    }
+
+    static count_fn Count64() {
+        static const count_fn fn = __builtin_cpu_supports("avx2") ? &Count64Avx2
+                : __builtin_cpu_supports("sse4.2") ? &Count64Sse : &CountScalar<8>;
+        return fn;
+    }
+
+#else
+
+    static count_fn Count32() { return &CountScalar<4>; }
+
+    static count_fn Count64() { return &CountScalar<8>; }
+
+#endif
+};
+
+#endif /* SRC_SIMD_SEARCH_H_ */
@@ -0,0 +1,461 @@
+/*
+ * typed_persistentbtree.h
+ *
+ * Compile-time typed front end of PersistentBTree. The key and data schemas
+ * are C++ types, for example
+ *
+ *     TypedPersistentBTree<std::tuple<int64_t, int32_t>, MyRow> tree;
+ *
+ * Keys can be a signed integer, double or bool column or a std::tuple of
+ * them. Data can be the same, or a trivially copyable struct that lists its
+ * columns in a `typedef std::tuple<...> columns;` member and has no padding.
+ *
+ * The files are the ones of the dynamic tree: keys are stored in the
+ * memcomparable KeyEncoding and data in the native column layout, so a
+ * table created here can be opened as a PersistentBTree and the other way
+ * round. Key encoding, comparisons (memcmp or SimdSearch of a constant
+ * size) and data copies are resolved at compile time, lookups descend the
+ * pages directly; structural changes go through the dynamic tree.
+ */
+
+#ifndef SRC_TYPED_PERSISTENTBTREE_H_
+#define SRC_TYPED_PERSISTENTBTREE_H_
+
+#include <stdint.h>
+#include <tuple>
+#include <type_traits>
+
+#include "persistentbtree.h"
+
+/// One column of a typed schema: its DataStructure type name and size, and
+/// the memcomparable encoding used for keys.
+template <typename T, typename Enable = void>
+struct TypedColumn;
+
+template <typename T>
+struct TypedColumn<T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type> {
+
+    static_assert(sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "unsupported integer column");
+
+    static const size_t size = sizeof(T);
+
+    static const char * Name() { return sizeof(T) == 2 ? "SHORT" : sizeof(T) == 4 ? "INT" : "INT64"; }
+
+    static void Encode(char * dst, const T & val) { KeyEncoding::EncodeInt(dst, val, size); }
+
+    static void Decode(const char * src, T & val) { val = (T) KeyEncoding::DecodeInt(src, size); }
+};
+
+template <>
+struct TypedColumn<double> {
+
+    static const size_t size = sizeof(double);
+
+    static const char * Name() { return "DOUBLE"; }
+
+    static void Encode(char * dst, const double & val) { KeyEncoding::EncodeDouble(dst, val); }
+
+    static void Decode(const char * src, double & val) { val = KeyEncoding::DecodeDouble(src); }
+};
+
+template <>
+struct TypedColumn<bool> {
+
+    static const size_t size = sizeof(bool);
+
+    static const char * Name() { return "BOOL"; }
+
+    static void Encode(char * dst, const bool & val) { *dst = val ? 1 : 0; }
+
+    static void Decode(const char * src, bool & val) { val = *src != 0; }
+};
+
+/// Columns I.. of a std::tuple
+template <typename Tuple, size_t I = 0, bool End = (I == std::tuple_size<Tuple>::value)>
+struct TypedTupleColumns {
+
+    typedef TypedColumn<typename std::tuple_element<I, Tuple>::type> column;
+    typedef TypedTupleColumns<Tuple, I + 1> rest;
+
+    static const size_t size = column::size + rest::size;
+
+    static void Types(std::vector<std::string> & types) {
+        types.push_back(column::Name());
+        rest::Types(types);
+    }
+
+    static void Encode(char * dst, const Tuple & val) {
+        column::Encode(dst, std::get<I>(val));
+        rest::Encode(dst + column::size, val);
+    }
+
+    static void Decode(const char * src, Tuple & val) {
+        column::Decode(src, std::get<I>(val));
+        rest::Decode(src + column::size, val);
+    }
+
+    static void Store(char * dst, const Tuple & val) {
+        memcpy(dst, &std::get<I>(val), column::size);
+        rest::Store(dst + column::size, val);
+    }
+
+    static void Load(const char * src, Tuple & val) {
+        memcpy(&std::get<I>(val), src, column::size);
+        rest::Load(src + column::size, val);
+    }
+};
+
+template <typename Tuple, size_t I>
+struct TypedTupleColumns<Tuple, I, true> {
+    static const size_t size = 0;
+    static void Types(std::vector<std::string> &) {}
+    static void Encode(char *, const Tuple &) {}
+    static void Decode(const char *, Tuple &) {}
+    static void Store(char *, const Tuple &) {}
+    static void Load(const char *, Tuple &) {}
+};
+
+template <typename T>
+struct TypedHasColumns {
+    template <typename U> static char Test(typename U::columns *);
+    template <typename U> static long Test(...);
+    static const bool value = sizeof(Test<T>(0)) == sizeof(char);
+};
+
+/// Schema of a key or data type. Encode/Decode write the memcomparable key
+/// format, Store/Load the native data format.
+template <typename T, typename Enable = void>
+struct TypedSchema {
+
+    typedef TypedColumn<T> column;
+
+    static const size_t size = column::size;
+
+    static const bool scalar = true;
+
+    static void Types(std::vector<std::string> & types) { types.push_back(column::Name()); }
+
+    static void Encode(char * dst, const T & val) { column::Encode(dst, val); }
+
+    static void Decode(const char * src, T & val) { column::Decode(src, val); }
+
+    static void Store(char * dst, const T & val) { memcpy(dst, &val, size); }
+
+    static void Load(const char * src, T & val) { memcpy(&val, src, size); }
+};
+
+template <typename... Ts>
+struct TypedSchema<std::tuple<Ts...> > {
+
+    typedef TypedTupleColumns<std::tuple<Ts...> > columns;
+
+    static const size_t size = columns::size;
+
+    static const bool scalar = false;
+
+    static void Types(std::vector<std::string> & types) { columns::Types(types); }
+
+    static void Encode(char * dst, const std::tuple<Ts...> & val) { columns::Encode(dst, val); }
+
+    static void Decode(const char * src, std::tuple<Ts...> & val) { columns::Decode(src, val); }
+
+    static void Store(char * dst, const std::tuple<Ts...> & val) { columns::Store(dst, val); }
+
+    static void Load(const char * src, std::tuple<Ts...> & val) { columns::Load(src, val); }
+};
+
+/// A row struct is stored as it is in memory, so its layout has to match
+/// the packed columns it declares.
+template <typename T>
+struct TypedSchema<T, typename std::enable_if<TypedHasColumns<T>::value>::type> {
+
+    typedef TypedTupleColumns<typename T::columns> columns;
+
+    static_assert(std::is_trivially_copyable<T>::value, "row types must be trivially copyable");
+    static_assert(sizeof(T) == columns::size, "row type has padding or does not match its columns");
+
+    static const size_t size = columns::size;
+
+    static const bool scalar = false;
+
+    static void Types(std::vector<std::string> & types) { columns::Types(types); }
+
+    static void Store(char * dst, const T & val) { memcpy(dst, &val, size); }
+
+    static void Load(const char * src, T & val) { memcpy(&val, src, size); }
+};
+
+template <typename Key, typename Data>
+class TypedPersistentBTree
+{
+public:
+
+    typedef Key key_type;
+
+    typedef Data data_type;
+
+    typedef TypedSchema<Key> key_schema;
+
+    typedef TypedSchema<Data> data_schema;
+
+    static const size_t keysize = key_schema::size;
+
+    static const size_t datasize = data_schema::size;
+
+    /// Single INT/INT64 keys are searched with SimdSearch
+    static const int simdwidth = (key_schema::scalar && std::is_integral<Key>::value
+            && (sizeof(Key) == 4 || sizeof(Key) == 8)) ? (int) sizeof(Key) : 0;
+
+    /// An encoded key, usable as a PersistentBTree::key_type
+    struct key_buffer {
+        char buf[keysize];
+        key_buffer() {}
+        explicit key_buffer(const Key & key) { key_schema::Encode(buf, key); }
+    };
+
+    struct data_buffer {
+        char buf[datasize];
+        data_buffer() {}
+        explicit data_buffer(const Data & data) { data_schema::Store(buf, data); }
+    };
+
+    class iterator
+    {
+    public:
+
+        iterator() {}
+
+        explicit iterator(const PersistentBTree::iterator & it) : m_it(it) {}
+
+        Key key() {
+            Key k;
+            key_schema::Decode(m_it.key().Data(), k);
+            return k;
+        }
+
+        Data data() {
+            Data d;
+            data_schema::Load(m_it.data().Data(), d);
+            return d;
+        }
+
+        iterator & operator++() { ++m_it; return *this; }
+
+        iterator & operator--() { --m_it; return *this; }
+
+        bool operator==(const iterator & x) const { return m_it == x.m_it; }
+
+        bool operator!=(const iterator & x) const { return m_it != x.m_it; }
+
+        /// The iterator of the dynamic tree
+        PersistentBTree::iterator & base() { return m_it; }
+
+    private:
+        PersistentBTree::iterator m_it;
+    };
+
+    /// Create the files of a new table with the schema of Key and Data
+    void create(const std::string & name) {
+        m_tree.create(name, Structure<key_schema>(), Structure<data_schema>(), true);
+    }
+
+    /// Open a table. Fails if its schema is not the one of Key and Data or
+    /// its keys are not memcomparable.
+    bool open(const std::string & name) {
+        m_tree.open(name);
+
+        if (!m_tree.is_open()) {
+            return false;
+        }
+
+        return m_tree.GetKeyStructure()->IsMemComparable()
+            && SameSchema(*m_tree.GetKeyStructure(), Structure<key_schema>())
+            && SameSchema(*m_tree.GetDataStructure(), Structure<data_schema>());
+    }
+
+    bool is_open() { return m_tree.is_open(); }
+
+    size_t size() const { return m_tree.size(); }
+
+    bool empty() const { return m_tree.empty(); }
+
+    iterator begin() { return iterator(m_tree.Begin()); }
+
+    iterator end() { return iterator(m_tree.End()); }
+
+    bool insert(const Key & key, const Data & data) {
+        key_buffer k(key);
+        data_buffer d(data);
+        return m_tree.insert(Wrap(k), Wrap(d)).second;
+    }
+
+    bool find(const Key & key, Data & data) {
+        key_buffer k(key);
+        const char * slot = FindData(k);
+        if (slot == NULL) {
+            return false;
+        }
+        data_schema::Load(slot, data);
+        return true;
+    }
+
+    bool exists(const Key & key) {
+        key_buffer k(key);
+        return FindData(k) != NULL;
+    }
+
+    iterator lower_bound(const Key & key) {
+        key_buffer k(key);
+        return iterator(m_tree.lower_bound(Wrap(k)));
+    }
+
+    bool erase(const Key & key) {
+        key_buffer k(key);
+        return m_tree.erase_one(Wrap(k));
+    }
+
+    size_t erase_range(const Key & lo, const Key & hi) {
+        key_buffer l(lo), h(hi);
+        return m_tree.erase_range(Wrap(l), Wrap(h));
+    }
+
+    /// Overwrite the data of an existing key in place
+    bool update(const Key & key, const Data & data) {
+        PersistentBTree::write_scope scope(&m_tree);
+        key_buffer k(key);
+        char * slot = FindData(k);
+        if (slot == NULL) {
+            return false;
+        }
+        data_schema::Store(slot, data);
+        return true;
+    }
+
+    /// Returns true if a new pair was inserted
+    bool insert_or_assign(const Key & key, const Data & data) {
+        return update(key, data) || insert(key, data);
+    }
+
+    /// fn(Data & data, bool found) changes the data of key, a value
+    /// initialized Data is passed in when it is new. Returns true if a new
+    /// pair was inserted.
+    template <typename Function>
+    bool upsert(const Key & key, Function fn) {
+        PersistentBTree::write_scope scope(&m_tree);
+        key_buffer k(key);
+        char * slot = FindData(k);
+
+        Data d = Data();
+
+        if (slot != NULL) {
+            data_schema::Load(slot, d);
+            fn(d, true);
+            data_schema::Store(slot, d);
+            return false;
+        }
+
+        fn(d, false);
+        data_buffer db(d);
+        m_tree.insert(Wrap(k), Wrap(db));
+        return true;
+    }
+
+    /// Bulk load a sorted range of std::pair<Key, Data> into an empty table
+    template <typename Iterator>
+    void bulk_load(Iterator first, Iterator last) {
+        std::vector<key_buffer> keys;
+        std::vector<data_buffer> data;
+        std::vector<PersistentBTree::pair_type> pairs;
+
+        for (Iterator it = first; it != last; ++it) {
+            keys.push_back(key_buffer(it->first));
+            data.push_back(data_buffer(it->second));
+        }
+        for (size_t i=0; i<keys.size(); i++) {
+            pairs.push_back(PersistentBTree::pair_type(Wrap(keys[i]), Wrap(data[i])));
+        }
+
+        m_tree.bulk_load(pairs.begin(), pairs.end());
+    }
+
+    /// The dynamic tree over the same files
+    PersistentBTree & dynamic() { return m_tree; }
+
+private:
+
+    DataType Wrap(key_buffer & k) { return DataType(m_tree.GetKeyStructure(), k.buf); }
+
+    DataType Wrap(data_buffer & d) { return DataType(m_tree.GetDataStructure(), d.buf); }
+
+    template <typename Schema>
+    static DataStructure Structure() {
+        std::vector<std::string> types;
+        Schema::Types(types);
+        return DataStructure(std::vector<std::string>(types));
+    }
+
+    static bool SameSchema(const DataStructure & a, const DataStructure & b) {
+        if (a.NTypes() != b.NTypes()) {
+            return false;
+        }
+        for (int i=0; i<a.NTypes(); i++) {
+            if (a.GetType(i) != b.GetType(i) || a.GetTypeSize(i) != b.GetTypeSize(i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// First slot of the node with a key >= k
+    static int FindLower(const char * slotkey, int slotuse, const key_buffer & k) {
+        if (simdwidth) {
+            return SimdSearch::LowerBound(slotkey, slotuse, k.buf, simdwidth, true,
+                    SimdSearch::DefaultWindow(simdwidth), SimdSearch::interpolation);
+        }
+
+        int lo = 0, hi = slotuse;
+        while (lo < hi) {
+            int mid = (lo + hi) >> 1;
+            if (memcmp(k.buf, slotkey + mid * keysize, keysize) <= 0) {
+                hi = mid;
+            }
+            else {
+                lo = mid + 1;
+            }
+        }
+        return lo;
+    }
+
+    /// Descend to the leaf of k and return its data slot, or NULL. m_leaf
+    /// keeps the page mapped until the next lookup.
+    char * FindData(const key_buffer & k) {
+        // the leaves are read directly, so buffered messages go first
+        m_tree.flush_messages();
+
+        if (m_tree.m_rootId == -1) {
+            return NULL;
+        }
+
+        PersistentBTree::node n = m_tree.get_node(m_tree.m_rootId);
+
+        while (!n.isleafnode()) {
+            int slot = FindLower(n->slotkey, n->slotuse, k);
+            n = m_tree.get_node(n->data.childid[slot]);
+        }
+
+        int slot = FindLower(n->slotkey, n->slotuse, k);
+
+        if (slot < n->slotuse && memcmp(k.buf, n->slotkey + slot * keysize, keysize) == 0) {
+            m_leaf = n;
+            return n->data.slotdata + slot * datasize;
+        }
+        return NULL;
+    }
+
+    PersistentBTree m_tree;
+
+    // keeps the page of the last data slot handed out mapped
+    PersistentBTree::node m_leaf;
+};
+
+#endif /* SRC_TYPED_PERSISTENTBTREE_H_ */